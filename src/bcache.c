@@ -0,0 +1,503 @@
+#include "common.h"
+#include "util.h"
+#include "block.h"
+#include "bcache.h"
+
+#ifdef FAKE
+#include <assert.h>
+#define BCACHE_ASSERT(p) assert(p)
+#else
+#define BCACHE_ASSERT(p) ASSERT(p)
+#endif
+
+/*	Buffer cache of fs blocks, keyed by fs block number.
+
+	Replacement is a simplified 2Q: a block seen for the first time enters a small FIFO
+	probation queue, and hits while it sits there do not count (a cat touches the same
+	block many times in a row). Blocks pushed out of probation are remembered in a ghost
+	list; if one of them is asked for again it goes to the main queue, which is managed
+	by CLOCK. A single large sequential read therefore only cycles the probation queue
+	and leaves directory and inode blocks alone.
+
+	Writes are held in the cache until the block is evicted or bcache_flush is called,
+	except whole runs written with bcache_write_range, which go straight to the device
+	when not cached. When the backend maps the image, mapped blocks are handed out
+	directly and never take a slot.
+*/
+
+#define BCACHE_HASH_SIZE (2 * BCACHE_MAX_SLOTS)
+
+// Queues
+#define BC_FREE 0 // Slot holds nothing
+#define BC_IN 1   // Probation FIFO
+#define BC_MAIN 2 // Main CLOCK queue
+
+typedef struct
+{
+    int block; // fs block held by the slot
+    int hash_next;
+    int fifo_prev, fifo_next;
+    uint16_t pin;
+    uint8_t dirty;
+    uint8_t ref;
+    uint8_t queue;
+    uint8_t prefetched; // Read ahead of use and not asked for since
+} bcache_slot;
+
+static char pool[BCACHE_BUDGET];
+static bcache_slot slots[BCACHE_MAX_SLOTS];
+static int hash_head[BCACHE_HASH_SIZE];
+
+static int ghost[BCACHE_MAX_SLOTS / 2 + 1];
+static int ghost_size, ghost_next;
+
+static int fifo_head, fifo_tail, fifo_len, fifo_max;
+
+static int slot_count;
+static int block_size;
+static int sectors_per_block;
+static int hand;
+
+static bcache_stat stats;
+
+// ==================== HELPERS ====================
+
+static char *slot_data(int i)
+{
+    return pool + i * block_size;
+}
+
+static int lookup(int block)
+{
+    int i = hash_head[block % BCACHE_HASH_SIZE];
+    while (i >= 0 && slots[i].block != block)
+        i = slots[i].hash_next;
+    return i;
+}
+
+static void hash_insert(int i)
+{
+    int bucket = slots[i].block % BCACHE_HASH_SIZE;
+    slots[i].hash_next = hash_head[bucket];
+    hash_head[bucket] = i;
+}
+
+static void hash_remove(int i)
+{
+    int *link = &hash_head[slots[i].block % BCACHE_HASH_SIZE];
+    while (*link != i)
+        link = &slots[*link].hash_next;
+    *link = slots[i].hash_next;
+}
+
+static void fifo_append(int i)
+{
+    slots[i].fifo_prev = fifo_tail;
+    slots[i].fifo_next = -1;
+    if (fifo_tail >= 0)
+        slots[fifo_tail].fifo_next = i;
+    else
+        fifo_head = i;
+    fifo_tail = i;
+    fifo_len++;
+}
+
+static void fifo_remove(int i)
+{
+    if (slots[i].fifo_prev >= 0)
+        slots[slots[i].fifo_prev].fifo_next = slots[i].fifo_next;
+    else
+        fifo_head = slots[i].fifo_next;
+    if (slots[i].fifo_next >= 0)
+        slots[slots[i].fifo_next].fifo_prev = slots[i].fifo_prev;
+    else
+        fifo_tail = slots[i].fifo_prev;
+    fifo_len--;
+}
+
+// Remove block from the ghost list, returns 1 if it was there
+static int ghost_take(int block)
+{
+    int i;
+    for (i = 0; i < ghost_size; i++)
+        if (ghost[i] == block)
+        {
+            ghost[i] = -1;
+            return 1;
+        }
+    return 0;
+}
+
+static void ghost_add(int block)
+{
+    if (ghost_size == 0)
+        return;
+    ghost[ghost_next] = block;
+    ghost_next = (ghost_next + 1) % ghost_size;
+}
+
+// A lookup found block in slot i
+static void slot_hit(int i)
+{
+    stats.hits++;
+    if (slots[i].prefetched)
+    {
+        slots[i].prefetched = 0;
+        stats.ra_hits++;
+    }
+}
+
+// ==================== WRITE BACK / EVICTION ====================
+
+static void writeback(int i)
+{
+    if (!slots[i].dirty)
+        return;
+    block_write_range(slots[i].block * sectors_per_block, sectors_per_block, slot_data(i));
+    slots[i].dirty = 0;
+    stats.writebacks++;
+}
+
+static void evict(int i)
+{
+    writeback(i);
+    hash_remove(i);
+    if (slots[i].prefetched)
+    {
+        slots[i].prefetched = 0;
+        stats.ra_waste++;
+    }
+    if (slots[i].queue == BC_IN)
+    {
+        fifo_remove(i);
+        ghost_add(slots[i].block);
+    }
+    slots[i].queue = BC_FREE;
+    slots[i].block = -1;
+}
+
+// First unpinned slot of the probation queue, or -1
+static int fifo_victim(void)
+{
+    int i;
+    for (i = fifo_head; i >= 0; i = slots[i].fifo_next)
+        if (slots[i].pin == 0)
+            return i;
+    return -1;
+}
+
+// Free a slot for a new block
+static int victim(void)
+{
+    int i, n;
+
+    for (i = 0; i < slot_count; i++)
+        if (slots[i].queue == BC_FREE)
+            return i;
+
+    if (fifo_len > fifo_max)
+    {
+        i = fifo_victim();
+        if (i >= 0)
+        {
+            evict(i);
+            return i;
+        }
+    }
+
+    // CLOCK over the main queue, clearing reference bits on the way
+    for (n = 0; n < 2 * slot_count; n++)
+    {
+        i = hand;
+        hand = (hand + 1) % slot_count;
+        if (slots[i].queue != BC_MAIN || slots[i].pin)
+            continue;
+        if (slots[i].ref)
+        {
+            slots[i].ref = 0;
+            continue;
+        }
+        evict(i);
+        return i;
+    }
+
+    i = fifo_victim();
+    BCACHE_ASSERT(i >= 0); // Every slot is pinned
+    evict(i);
+    return i;
+}
+
+// ==================== INTERFACE ====================
+
+// Size the cache for block_size byte blocks within budget bytes, dropping whatever it held
+void bcache_init(int bsize, int budget)
+{
+    int i;
+
+    if (budget > BCACHE_BUDGET)
+        budget = BCACHE_BUDGET;
+
+    block_size = bsize;
+    sectors_per_block = bsize / BLOCK_SIZE;
+    slot_count = budget / bsize;
+    if (slot_count > BCACHE_MAX_SLOTS)
+        slot_count = BCACHE_MAX_SLOTS;
+    BCACHE_ASSERT(slot_count >= 8);
+
+    for (i = 0; i < BCACHE_MAX_SLOTS; i++)
+    {
+        slots[i].block = -1;
+        slots[i].queue = BC_FREE;
+        slots[i].pin = 0;
+        slots[i].dirty = 0;
+        slots[i].prefetched = 0;
+    }
+    for (i = 0; i < BCACHE_HASH_SIZE; i++)
+        hash_head[i] = -1;
+
+    ghost_size = slot_count / 2;
+    ghost_next = 0;
+    for (i = 0; i < ghost_size; i++)
+        ghost[i] = -1;
+
+    fifo_head = fifo_tail = -1;
+    fifo_len = 0;
+    fifo_max = slot_count / 4;
+    hand = 0;
+}
+
+static char *cache_get(int block, int fill)
+{
+    int i = lookup(block);
+    if (i >= 0)
+    {
+        if (slots[i].queue == BC_MAIN)
+            slots[i].ref = 1;
+        slots[i].pin++;
+        slot_hit(i);
+        return slot_data(i);
+    }
+
+    char *mapped = block_map(block * sectors_per_block, sectors_per_block);
+    if (mapped != NULL)
+    {
+        stats.hits++;
+        return mapped;
+    }
+
+    i = victim();
+    slots[i].block = block;
+    slots[i].pin = 1;
+    slots[i].dirty = 0;
+    slots[i].ref = 0;
+    hash_insert(i);
+
+    if (ghost_take(block))
+        slots[i].queue = BC_MAIN;
+    else
+    {
+        slots[i].queue = BC_IN;
+        fifo_append(i);
+    }
+
+    if (fill)
+    {
+        block_read_range(block * sectors_per_block, sectors_per_block, slot_data(i));
+        stats.misses++;
+    }
+    return slot_data(i);
+}
+
+// Pin block in the cache and return its contents
+char *bcache_get(int block)
+{
+    return cache_get(block, 1);
+}
+
+// Pin block without reading it, for callers about to overwrite all of it
+char *bcache_get_new(int block)
+{
+    return cache_get(block, 0);
+}
+
+// Copy count consecutive blocks into mem. Blocks not in the cache are read straight into mem,
+// each uncached stretch with one device request, and are not cached: a large read would only
+// push everything else out.
+void bcache_read_range(int first, int count, char *mem)
+{
+    int i, slot, miss_start = -1;
+    char *src;
+
+    for (i = 0; i <= count; i++)
+    {
+        src = NULL;
+        if (i < count)
+        {
+            slot = lookup(first + i);
+            if (slot >= 0)
+            {
+                src = slot_data(slot);
+                slot_hit(slot);
+            }
+            else
+            {
+                src = block_map((first + i) * sectors_per_block, sectors_per_block);
+                if (src != NULL)
+                    stats.hits++;
+            }
+            if (src == NULL)
+            {
+                if (miss_start < 0)
+                    miss_start = i;
+                continue;
+            }
+        }
+
+        if (miss_start >= 0) // End of an uncached stretch
+        {
+            block_read_range((first + miss_start) * sectors_per_block, (i - miss_start) * sectors_per_block,
+                             mem + miss_start * block_size);
+            stats.misses += i - miss_start;
+            miss_start = -1;
+        }
+        if (src != NULL)
+            bcopy((unsigned char *)src, (unsigned char *)(mem + i * block_size), block_size);
+    }
+}
+
+// Write count consecutive blocks from mem. Cached blocks take the new contents in their slot, to go
+// out with the next writeback. The others are written straight from mem, each uncached stretch with
+// one device request, without taking a slot or being read first.
+void bcache_write_range(int first, int count, char *mem)
+{
+    int i, slot, miss_start = -1;
+    char *dst;
+
+    for (i = 0; i <= count; i++)
+    {
+        dst = NULL;
+        if (i < count)
+        {
+            slot = lookup(first + i);
+            if (slot >= 0)
+            {
+                dst = slot_data(slot);
+                slots[slot].dirty = 1;
+                slots[slot].prefetched = 0;
+            }
+            else
+                dst = block_map((first + i) * sectors_per_block, sectors_per_block);
+            if (dst == NULL)
+            {
+                if (miss_start < 0)
+                    miss_start = i;
+                continue;
+            }
+        }
+
+        if (miss_start >= 0) // End of an uncached stretch
+        {
+            block_write_range((first + miss_start) * sectors_per_block, (i - miss_start) * sectors_per_block,
+                              mem + miss_start * block_size);
+            stats.writebacks += i - miss_start;
+            miss_start = -1;
+        }
+        if (dst != NULL)
+            bcopy((unsigned char *)(mem + i * block_size), (unsigned char *)dst, block_size);
+    }
+}
+
+// Read up to count consecutive blocks into the cache ahead of use, each stretch of them not cached
+// yet with one device request straight into their slots. They go to the probation queue like any new
+// block, and never more than it holds, so that they do not push each other out. Returns how many
+// blocks from first were covered.
+int bcache_prefetch(int first, int count)
+{
+    char *bufs[BLOCK_WRITEV_MAX];
+    int i, j, miss_start = -1;
+
+    if (count > BCACHE_PREFETCH_MAX / block_size)
+        count = BCACHE_PREFETCH_MAX / block_size;
+    if (count > BLOCK_WRITEV_MAX)
+        count = BLOCK_WRITEV_MAX;
+    if (count > fifo_max)
+        count = fifo_max;
+
+    for (i = 0; i <= count; i++)
+    {
+        if (i < count && lookup(first + i) < 0 && block_map((first + i) * sectors_per_block, sectors_per_block) == NULL)
+        {
+            if (miss_start < 0)
+                miss_start = i;
+            continue;
+        }
+        if (miss_start < 0)
+            continue;
+
+        for (j = miss_start; j < i; j++) // Pinned until the read is done
+            bufs[j - miss_start] = cache_get(first + j, 0);
+        block_readv((first + miss_start) * sectors_per_block, sectors_per_block, i - miss_start, bufs);
+        for (j = miss_start; j < i; j++)
+        {
+            slots[lookup(first + j)].prefetched = 1;
+            bcache_put(first + j, 0);
+        }
+        miss_start = -1;
+    }
+    return count;
+}
+
+// Mark a pinned block as modified
+void bcache_dirty(int block)
+{
+    int i = lookup(block);
+    if (i >= 0)
+        slots[i].dirty = 1;
+}
+
+// Release a block obtained from bcache_get, dirty if the caller modified it
+void bcache_put(int block, int dirty)
+{
+    int i = lookup(block);
+    if (i < 0) // Mapped block
+        return;
+
+    BCACHE_ASSERT(slots[i].pin > 0);
+    if (dirty)
+        slots[i].dirty = 1;
+    slots[i].pin--;
+}
+
+// Write every dirty block back to the device, in block order so that runs of
+// consecutive blocks go out as one vectored write
+void bcache_flush(void)
+{
+    static int dirty[BCACHE_MAX_SLOTS];
+    char *bufs[BLOCK_WRITEV_MAX];
+    int i, j, n = 0;
+
+    for (i = 0; i < slot_count; i++)
+        if (slots[i].queue != BC_FREE && slots[i].dirty)
+        {
+            // Insertion sort by block, the dirty set is small
+            for (j = n++; j > 0 && slots[dirty[j - 1]].block > slots[i].block; j--)
+                dirty[j] = dirty[j - 1];
+            dirty[j] = i;
+        }
+
+    for (i = 0; i < n; i += j)
+    {
+        for (j = 0; i + j < n && j < BLOCK_WRITEV_MAX && slots[dirty[i + j]].block == slots[dirty[i]].block + j; j++)
+        {
+            bufs[j] = slot_data(dirty[i + j]);
+            slots[dirty[i + j]].dirty = 0;
+        }
+        block_writev(slots[dirty[i]].block * sectors_per_block, sectors_per_block, j, bufs);
+        stats.writebacks += j;
+    }
+}
+
+void bcache_stats(bcache_stat *buf)
+{
+    *buf = stats;
+}
@@ -0,0 +1,38 @@
+#ifndef BCACHE_INCLUDED
+#define BCACHE_INCLUDED
+
+#include "common.h"
+
+// Memory reserved for cached blocks, in bytes. Override with -DBCACHE_BUDGET=...
+#ifndef BCACHE_BUDGET
+#define BCACHE_BUDGET (1024 * 1024)
+#endif
+
+// Smallest fs block the cache is sized for
+#define BCACHE_MIN_BLOCK 4096
+#define BCACHE_MAX_SLOTS (BCACHE_BUDGET / BCACHE_MIN_BLOCK)
+
+// Most bytes bcache_prefetch reads in one call
+#define BCACHE_PREFETCH_MAX (128 * 1024)
+
+typedef struct
+{
+    uint32_t hits;       // Lookups served from memory
+    uint32_t misses;     // Lookups that had to read the device
+    uint32_t writebacks; // Dirty blocks written to the device
+    uint32_t ra_hits;    // Prefetched blocks asked for later
+    uint32_t ra_waste;   // Prefetched blocks evicted without being asked for
+} bcache_stat;
+
+void bcache_init(int block_size, int budget);
+char *bcache_get(int block);
+char *bcache_get_new(int block);
+void bcache_dirty(int block);
+void bcache_read_range(int first, int count, char *mem);
+void bcache_write_range(int first, int count, char *mem);
+int bcache_prefetch(int first, int count);
+void bcache_put(int block, int dirty);
+void bcache_flush(void);
+void bcache_stats(bcache_stat *buf);
+
+#endif
@@ -8,10 +8,20 @@
 #define BLOCK_SIZE (1 << BLOCK_SIZE_BITS) // 512 bytes
 #define BLOCK_MASK (BLOCK_SIZE - 1)
 
+// Most buffers block_writev and block_readv take in one call
+#define BLOCK_WRITEV_MAX 64
+
 void bzero_block(char *block);
 void block_init(void);
 void block_read(int block, char *mem);
 void block_write(int block, char *mem);
+void block_read_range(int first, int count, char *mem);
+void block_write_range(int first, int count, char *mem);
+void block_writev(int first, int count, int nbufs, char **bufs);
+void block_readv(int first, int count, int nbufs, char **bufs);
+char *block_map(int first, int count);
+int block_sectors(void);
+void block_sync(void);
 void bzero_block_custom(int block);
 
 #endif
@@ -1,50 +1,144 @@
-#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
 #include <assert.h>
 #include "common.h"
 #include "block.h"
 
-static FILE *fd;
+static int fd = -1;
 
 #include <errno.h>
 
 void block_init(void)
 {
-	int ret;
+	fd = open("./disk", O_RDWR | O_CREAT, 0644);
+	assert(fd >= 0);
+}
 
-	fd = fopen("./disk", "r+");
-	if (fd == NULL)
-		fd = fopen("./disk", "w+");
-	assert(fd);
+// Read count consecutive sectors starting at first with a single pread.
+// Sectors past the end of the image read back as zeros.
+void block_read_range(int first, int count, char *mem)
+{
+	ssize_t ret;
+	size_t done = 0;
+	size_t len = (size_t)count * BLOCK_SIZE;
+	off_t offset = (off_t)first * BLOCK_SIZE;
 
-	ret = fseek(fd, 0, SEEK_SET);
-	assert(ret == 0);
+	while (done < len)
+	{
+		ret = pread(fd, mem + done, len - done, offset + done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		assert(ret >= 0);
+		if (ret == 0)
+		{ /* End of file */
+			for (; done < len; done++)
+				mem[done] = 0;
+			break;
+		}
+		done += ret;
+	}
 }
 
-void block_read(int block, char *mem)
+// Write count consecutive sectors starting at first with a single pwrite.
+void block_write_range(int first, int count, char *mem)
 {
-	int ret;
+	ssize_t ret;
+	size_t done = 0;
+	size_t len = (size_t)count * BLOCK_SIZE;
+	off_t offset = (off_t)first * BLOCK_SIZE;
 
-	ret = fseek(fd, block * BLOCK_SIZE, SEEK_SET);
-	assert(ret == 0);
+	while (done < len)
+	{
+		ret = pwrite(fd, mem + done, len - done, offset + done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		assert(ret > 0);
+		done += ret;
+	}
+}
 
-	ret = fread(mem, 1, BLOCK_SIZE, fd);
-	if (ret == 0)
-	{ /* End of file */
-		ret = BLOCK_SIZE;
-		bzero_block(mem);
+// Write nbufs buffers of count sectors each to consecutive sectors starting at first, with one pwritev
+void block_writev(int first, int count, int nbufs, char **bufs)
+{
+	struct iovec iov[BLOCK_WRITEV_MAX];
+	ssize_t ret;
+	size_t len = (size_t)count * BLOCK_SIZE;
+	int i;
+
+	assert(nbufs <= BLOCK_WRITEV_MAX);
+	for (i = 0; i < nbufs; i++)
+	{
+		iov[i].iov_base = bufs[i];
+		iov[i].iov_len = len;
 	}
-	assert(ret == BLOCK_SIZE);
+
+	do
+		ret = pwritev(fd, iov, nbufs, (off_t)first * BLOCK_SIZE);
+	while (ret < 0 && errno == EINTR);
+	assert(ret >= 0);
+
+	/* Short write: finish buffer by buffer */
+	for (i = ret / len; i < nbufs; i++)
+		block_write_range(first + i * count, count, bufs[i]);
 }
 
-void block_write(int block, char *mem)
+// Read nbufs buffers of count sectors each from consecutive sectors starting at first, with one preadv
+void block_readv(int first, int count, int nbufs, char **bufs)
+{
+	struct iovec iov[BLOCK_WRITEV_MAX];
+	ssize_t ret;
+	size_t len = (size_t)count * BLOCK_SIZE;
+	int i;
+
+	assert(nbufs <= BLOCK_WRITEV_MAX);
+	for (i = 0; i < nbufs; i++)
+	{
+		iov[i].iov_base = bufs[i];
+		iov[i].iov_len = len;
+	}
+
+	do
+		ret = preadv(fd, iov, nbufs, (off_t)first * BLOCK_SIZE);
+	while (ret < 0 && errno == EINTR);
+	assert(ret >= 0);
+
+	/* Short read: finish buffer by buffer, past the end of the image they read back as zeros */
+	for (i = ret / len; i < nbufs; i++)
+		block_read_range(first + i * count, count, bufs[i]);
+}
+
+// Sectors are only reachable through read/write calls in this backend
+char *block_map(int first, int count)
+{
+	return NULL;
+}
+
+// Sectors currently in the image file
+int block_sectors(void)
+{
+	off_t end = lseek(fd, 0, SEEK_END);
+
+	assert(end >= 0);
+	return end / BLOCK_SIZE;
+}
+
+void block_sync(void)
 {
 	int ret;
 
-	ret = fseek(fd, block * BLOCK_SIZE, SEEK_SET);
+	ret = fsync(fd);
 	assert(ret == 0);
+}
 
-	ret = fwrite(mem, 1, BLOCK_SIZE, fd);
-	assert(ret == BLOCK_SIZE);
+void block_read(int block, char *mem)
+{
+	block_read_range(block, 1, mem);
+}
+
+void block_write(int block, char *mem)
+{
+	block_write_range(block, 1, mem);
 }
 
 void bzero_block(char *block)
@@ -55,20 +149,10 @@ void bzero_block(char *block)
 		block[i] = 0;
 }
 
-// Clear the content of 8 consecutive blocks in the file, using a temporary buffer block_buffer
+// Clear the content of 8 consecutive blocks in the file with one write
 void bzero_block_custom(int block)
 {
-	char block_buffer[BLOCK_SIZE];
-	bzero_block(block_buffer);
+	static char zero_buffer[8 * BLOCK_SIZE];
 
-	int ret;
-	int i;
-	for (i = 0; i < 8; i++)
-	{
-		ret = fseek(fd, (block * 8 + i) * BLOCK_SIZE, SEEK_SET);
-		assert(ret == 0);
-
-		ret = fwrite(block_buffer, 1, BLOCK_SIZE, fd);
-		assert(ret == BLOCK_SIZE);
-	}
-}
\ No newline at end of file
+	block_write_range(block * 8, 8, zero_buffer);
+}
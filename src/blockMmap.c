@@ -0,0 +1,135 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <assert.h>
+#include "common.h"
+#include "block.h"
+
+// Address space reserved for the image. The file itself only grows as sectors get written,
+// but the mapping never moves, so pointers handed out by block_map stay valid.
+#ifndef MMAP_RESERVE
+#define MMAP_RESERVE (1ULL << 34)
+#endif
+
+// The image is extended in steps of this many bytes
+#define MMAP_GROW_STEP (1 << 20)
+
+static int fd = -1;
+static char *image;
+static off_t image_size; // Bytes currently backed by the file
+
+void block_init(void)
+{
+	fd = open("./disk", O_RDWR | O_CREAT, 0644);
+	assert(fd >= 0);
+
+	image_size = lseek(fd, 0, SEEK_END);
+	assert(image_size >= 0);
+
+	image = mmap(NULL, MMAP_RESERVE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	assert(image != MAP_FAILED);
+}
+
+// Make sure the file backs the mapping up to end bytes, otherwise touching those pages faults
+static void image_grow(off_t end)
+{
+	int ret;
+
+	if (end <= image_size)
+		return;
+	assert(end <= (off_t)MMAP_RESERVE);
+
+	end = (end + MMAP_GROW_STEP - 1) / MMAP_GROW_STEP * MMAP_GROW_STEP;
+	ret = ftruncate(fd, end);
+	assert(ret == 0);
+	image_size = end;
+}
+
+// Pointer to count sectors starting at first inside the mapping, or NULL if they lie past the end of the image
+char *block_map(int first, int count)
+{
+	off_t end = ((off_t)first + count) * BLOCK_SIZE;
+
+	if (end > image_size)
+		return NULL;
+	return image + (off_t)first * BLOCK_SIZE;
+}
+
+// Sectors currently backed by the image file
+int block_sectors(void)
+{
+	return image_size / BLOCK_SIZE;
+}
+
+void block_read_range(int first, int count, char *mem)
+{
+	off_t offset = (off_t)first * BLOCK_SIZE;
+	off_t len = (off_t)count * BLOCK_SIZE;
+	off_t avail = image_size - offset;
+
+	if (avail <= 0)
+		avail = 0;
+	if (avail > len)
+		avail = len;
+
+	memcpy(mem, image + offset, avail);
+	memset(mem + avail, 0, len - avail); /* End of file */
+}
+
+void block_write_range(int first, int count, char *mem)
+{
+	off_t offset = (off_t)first * BLOCK_SIZE;
+
+	image_grow(offset + (off_t)count * BLOCK_SIZE);
+	memcpy(image + offset, mem, (size_t)count * BLOCK_SIZE);
+}
+
+void block_writev(int first, int count, int nbufs, char **bufs)
+{
+	int i;
+
+	image_grow(((off_t)first + (off_t)count * nbufs) * BLOCK_SIZE);
+	for (i = 0; i < nbufs; i++)
+		memcpy(image + ((off_t)first + (off_t)i * count) * BLOCK_SIZE, bufs[i], (size_t)count * BLOCK_SIZE);
+}
+
+void block_readv(int first, int count, int nbufs, char **bufs)
+{
+	int i;
+
+	for (i = 0; i < nbufs; i++)
+		block_read_range(first + i * count, count, bufs[i]);
+}
+
+void block_read(int block, char *mem)
+{
+	block_read_range(block, 1, mem);
+}
+
+void block_write(int block, char *mem)
+{
+	block_write_range(block, 1, mem);
+}
+
+void block_sync(void)
+{
+	int ret;
+
+	ret = msync(image, image_size, MS_SYNC);
+	assert(ret == 0);
+}
+
+void bzero_block(char *block)
+{
+	memset(block, 0, BLOCK_SIZE);
+}
+
+// Clear the content of 8 consecutive blocks directly in the mapping
+void bzero_block_custom(int block)
+{
+	off_t offset = (off_t)block * 8 * BLOCK_SIZE;
+
+	image_grow(offset + 8 * BLOCK_SIZE);
+	memset(image + offset, 0, 8 * BLOCK_SIZE);
+}
@@ -48,6 +48,7 @@ enum
 	SYSCALL_READDIR, /* 25 */
 	SYSCALL_LOADPROC,
 	SYSCALL_WRITE_SERIAL,
+	SYSCALL_SYNC,
 	SYSCALL_COUNT
 };
 
@@ -113,6 +114,10 @@ typedef unsigned long ulong_t;
 #define FS_O_WRONLY 2
 #define FS_O_RDWR 3
 
+#define FS_SEEK_SET 0 // From the start of the file
+#define FS_SEEK_CUR 1 // From the cursor
+#define FS_SEEK_END 2 // From the end of the file
+
 typedef struct
 {
 	// Fill in your stat here, this is just an example
@@ -123,6 +128,21 @@ typedef struct
 	int numBlocks; /* number of blocks used by the file */
 } fileStat;
 
+/*	Geometry for fs_mkfs. Fields left at 0, or a NULL geometry, take the defaults. */
+typedef struct
+{
+	int imageMB;	/* image size in MiB */
+	int blockSize;	/* bytes per block, a power of two from 4 KiB to 64 KiB */
+	int inodeCount; /* most inodes the fs may hold, spread over the groups, 0 for the default of 2048 */
+} fsGeometry;
+
+/*	A piece of the caller's memory for fs_readv / fs_writev, the pieces are taken one after the other. */
+typedef struct
+{
+	char *base; /* first byte of the piece */
+	int len;	/* bytes in the piece */
+} fsIovec;
+
 /*	Note that this struct only allocates space for the size element.
 
 	To use a message with a body of 50 bytes we must first allocate space for
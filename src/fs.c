@@ -1,37 +1,67 @@
 #include "util.h"
 #include "common.h"
 #include "block.h"
+#include "bcache.h"
 #include "fs.h"
 
 #ifdef FAKE
 #include <stdio.h>
+#include <assert.h>
+#include <time.h>
 #define ERROR_MSG(m) printf m;
+#define FS_ASSERT(p) assert(p)
+#define FS_CLOCK() time(NULL)
 #else
 #define ERROR_MSG(m)
+#define FS_ASSERT(p) ASSERT(p)
+#define FS_CLOCK() 0 // No clock: only the other commit points apply
 #endif
 
 // ==================== VAR DEF ====================
 
-static char block_copy[NEW_BLOCK_SIZE];
-static char block_copy_copy[NEW_BLOCK_SIZE];
-
 // Super Block Structure / Copy
-static char super_block_copy[NEW_BLOCK_SIZE];
+static char super_block_copy[SUPER_BLOCK_SIZE];
 static super_block_structure *created_super_block = (super_block_structure *)super_block_copy;
 
-// Pointers for last bitmap pos
-static uint16_t inode_bitmap_last = 0;
-static uint16_t dblock_bitmap_last = 0;
+// Pointer for last data bitmap pos
+static uint32_t dblock_bitmap_last = 0;
 
 // Pwd
-static uint16_t pwd;
+static uint32_t pwd;
+
+// Geometry of the mounted fs
+static fs_layout geo;
 
 // File Descriptor
 static file_desc_structure file_desc_table[MAX_FILE_OPEN];
 
-// Bitmap
-static char inode_bitmap_block_copy[NEW_BLOCK_SIZE];
-static char dblock_bitmap_block_copy[NEW_BLOCK_SIZE];
+// Decoded inodes, written back to the inode table in whole blocks
+static icache_entry inode_cache[ICACHE_SIZE];
+
+// Names looked up lately, and how often that paid off
+static dcache_entry dentry_cache[DCACHE_SIZE];
+static uint32_t dcache_hits, dcache_misses;
+
+// Bloom filters of the directories with recent misses
+static dir_bloom bloom_cache[BLOOM_CACHE];
+static int bloom_hand;
+static uint32_t bloom_rejects;
+
+// Superblock changed since the last commit / checkpoint
+static bool_t sb_dirty = FALSE;
+static bool_t sb_backup_dirty = FALSE;
+
+// When the last commit happened, in FS_CLOCK seconds
+static long last_commit;
+
+// Bitmaps indexed by INODE_BITMAP / DBLOCK_BITMAP, the per group bitmaps of each kind one after the other
+static char inode_bitmap_bits[MAX_INODE_BITMAP] __attribute__((aligned(8))); // Scanned in 64 bit words
+static char dblock_bitmap_bits[MAX_DBLOCK_BITMAP] __attribute__((aligned(8)));
+static char *bitmap[2] = {inode_bitmap_bits, dblock_bitmap_bits};
+
+// Sectors [lo, hi) of each group bitmap block modified since the last commit
+static int bitmap_dirty_lo[2][MAX_GROUPS];
+static int bitmap_dirty_hi[2][MAX_GROUPS];
 
 #include "fsutil.c"
 
@@ -40,86 +70,129 @@ static char dblock_bitmap_block_copy[NEW_BLOCK_SIZE];
 void fs_init(void)
 {
     block_init(); // Call block init
+    icache_init();
+    dcache_init();
+    bloom_init();
+    last_commit = FS_CLOCK();
 
     // Pointer to copy based on SB structre
     created_super_block = (super_block_structure *)super_block_copy;
 
-    adapt_block_read(SUPER_BLOCK, super_block_copy);
+    sb_read(SUPER_BLOCK_SECTOR);
 
-    // Verify magic number
-    if (created_super_block->magic_num != MAGIC_NUMBER)
+    // Verify magic number and geometry
+    if (layout_load() < 0)
     {
-        // Try backup
-        adapt_block_read(SUPER_BLOCK_BACKUP, super_block_copy);
-        if (created_super_block->magic_num != MAGIC_NUMBER)
+        // Try backup, at the end of the image
+        geo.image_sectors = block_sectors();
+        if (geo.image_sectors >= 2 * SUPER_BLOCK_SECTOR + SUPER_BLOCK_SECTORS)
+            sb_read(SUPER_BLOCK_BACKUP);
+        if (geo.image_sectors < 2 * SUPER_BLOCK_SECTOR + SUPER_BLOCK_SECTORS || layout_load() < 0)
         {
-            fs_mkfs(); // Disk formating
+            fs_mkfs(NULL); // Disk formating
             return;
         }
         else
-            adapt_block_write(SUPER_BLOCK, super_block_copy);
+        {
+            sb_write(SUPER_BLOCK_SECTOR);
+        }
     }
+    bcache_init(NEW_BLOCK_SIZE, BCACHE_BUDGET);
 
     // Root directory stored at pwd var
-    pwd = (uint16_t)PWD_ID_ROOT_DIR;
+    pwd = PWD_ID_ROOT_DIR;
 
     // Bzero to clear file descriptor table
     bzero((char *)file_desc_table, sizeof(file_desc_table));
 
     //  Load bitmaps
-    adapt_block_read(created_super_block->inode_bitmap_place, inode_bitmap_block_copy);
-    adapt_block_read(created_super_block->dblock_bitmap_place, dblock_bitmap_block_copy);
+    bitmap_load();
 }
 
 // ==================== MKFS ====================
 
-int fs_mkfs(void)
+// Format with the given geometry, NULL or 0 fields for the defaults
+int fs_mkfs(fsGeometry *geometry)
 {
+    fs_layout new_geo;
+    int image_mb = DEFAULT_IMAGE_MB, block_size = DEFAULT_BLOCK_SIZE, inode_count = DEFAULT_INODE_COUNT;
+
+    if (geometry != NULL)
+    {
+        if (geometry->imageMB != 0)
+            image_mb = geometry->imageMB;
+        if (geometry->blockSize != 0)
+            block_size = geometry->blockSize;
+        if (geometry->inodeCount != 0)
+            inode_count = geometry->inodeCount;
+    }
+    if (layout_make(&new_geo, image_mb, block_size, inode_count) < 0)
+    {
+        ERROR_MSG(("Unsupported geometry.\n"))
+        return -1;
+    }
+
+    // Whatever is cached belongs to the old fs, and may have another block size
+    geo = new_geo;
+    bcache_init(NEW_BLOCK_SIZE, BCACHE_BUDGET);
+
     // Init super block with structure
     created_super_block = (super_block_structure *)super_block_copy;
 
-    created_super_block->file_sys_size = FS_SIZE;
+    bzero(super_block_copy, SUPER_BLOCK_SIZE);
+    created_super_block->file_sys_size = geo.image_sectors;
+    created_super_block->block_size = NEW_BLOCK_SIZE;
     created_super_block->inode_count = 1; // Initial inode number
-    created_super_block->inode_bitmap_place = SUPER_BLOCK + 1;
-    created_super_block->inode_start = SUPER_BLOCK + 3;
     created_super_block->magic_num = MAGIC_NUMBER;
-    created_super_block->dblock_bitmap_place = SUPER_BLOCK + 2;
-    created_super_block->dblock_start = SUPER_BLOCK + 3 + INODE_BLOCK_NUMBER;
+    created_super_block->dblock_start = layout_dblock_start(NEW_BLOCK_SIZE);
+    created_super_block->dblock_count = 0;
 
-    // Create Backup
-    adapt_block_write(SUPER_BLOCK, super_block_copy);
-    adapt_block_write(SUPER_BLOCK_BACKUP, super_block_copy);
+    // Primary and backup are both written at the checkpoint below
+    sb_mark_dirty();
 
     // Reset bitmap for inode and data block
-    bzero_block_custom(created_super_block->inode_bitmap_place);
-    bzero_block_custom(created_super_block->dblock_bitmap_place);
+    bitmap_reset();
 
-    bzero(inode_bitmap_block_copy, NEW_BLOCK_SIZE);
-    bzero(dblock_bitmap_block_copy, NEW_BLOCK_SIZE);
+    // Lay out the groups, reserving their metadata and the backup superblock in the data bitmap
+    group_init();
 
-    // Reset pointers
-    inode_bitmap_last = 0;
+    // Nothing cached from a previous fs is valid anymore
+    icache_init();
+    dcache_init();
+    bloom_init();
+
+    // Reset pointer
     dblock_bitmap_last = 0;
 
     inode temp_root;
+    if (inode_chunk_alloc(PWD_ID_ROOT_DIR) < 0)
+    {
+        bzero(super_block_copy, SUPER_BLOCK_SIZE);
+        sb_mark_dirty();
+        fs_checkpoint();
+        return -1;
+    }
     inode_init(&temp_root, POS_DIRECTORY);
     inode_write(PWD_ID_ROOT_DIR, &temp_root);
     write_bitmap_block(INODE_BITMAP, PWD_ID_ROOT_DIR, 1);
+    created_super_block->groups[0].dir_count++;
 
     // Adding directory entries to root "." and ".."
     int res;
     res = add_2_directory_entry(PWD_ID_ROOT_DIR, PWD_ID_ROOT_DIR, ".");
     if (res < 0)
     {
-        bzero(super_block_copy, NEW_BLOCK_SIZE);
-        sb_write();
+        bzero(super_block_copy, SUPER_BLOCK_SIZE);
+        sb_mark_dirty();
+        fs_checkpoint();
         return -1;
     }
     res = add_2_directory_entry(PWD_ID_ROOT_DIR, PWD_ID_ROOT_DIR, "..");
     if (res < 0)
     {
-        bzero(super_block_copy, NEW_BLOCK_SIZE);
-        sb_write();
+        bzero(super_block_copy, SUPER_BLOCK_SIZE);
+        sb_mark_dirty();
+        fs_checkpoint();
         return -1;
     }
 
@@ -129,6 +202,7 @@ int fs_mkfs(void)
     // Clear table
     bzero((char *)file_desc_table, sizeof(file_desc_table));
 
+    fs_checkpoint();
     return 0;
 }
 
@@ -154,7 +228,7 @@ int fs_open(char *fileName, int flags)
             ERROR_MSG(("%s Can not open besides read only.\n", fileName))
             return -1;
         }
-        else // Not only read only case
+        else // Not only read only case, create the file
         {
             resolved_path = path_resolve(fileName, pwd, 2);
             if (resolved_path < 0)
@@ -163,6 +237,29 @@ int fs_open(char *fileName, int flags)
                 ERROR_MSG(("Path does not exist.\n"));
                 return -1;
             }
+
+            // Name of the new entry is the last path component
+            char *base_name = path_base_name(fileName);
+            if (strlen(base_name) > MAX_FILE_NAME)
+            {
+                fd_close(new_fd);
+                ERROR_MSG(("File name size beyond limit.\n"))
+                return -1;
+            }
+
+            int created_inode = inode_create(resolved_path, REAL_FILE);
+            if (created_inode < 0)
+            {
+                fd_close(new_fd);
+                return -1;
+            }
+            if (add_2_directory_entry(resolved_path, created_inode, base_name) < 0)
+            {
+                inode_free(created_inode);
+                fd_close(new_fd);
+                return -1;
+            }
+            file_desc_table[new_fd].inode_id = created_inode;
         }
     }
     else
@@ -177,6 +274,7 @@ int fs_open(char *fileName, int flags)
         }
         file_desc_table[new_fd].inode_id = resolved_path; // Store at descriptor table
     }
+    fs_commit_tick();
     return new_fd;
 }
 
@@ -184,18 +282,8 @@ int fs_open(char *fileName, int flags)
 
 int fs_close(int fd)
 {
-    // Check file descriptor usage
-    if (file_desc_table[fd].is_using == FALSE)
-    {
-        ERROR_MSG(("%d this file descriptor is not in use.", fd))
+    if (fd_check(fd) < 0)
         return -1;
-    }
-
-    if (fd < 0 || fd >= MAX_FILE_OPEN)
-    {
-        ERROR_MSG(("Wrong input for file descriptor.\n"))
-        return -1;
-    }
     fd_close(fd);
 
     // Opened file descriptors that shares same inode id
@@ -207,13 +295,26 @@ int fs_close(int fd)
         if (temp.link_count == 0)
             inode_free(file_desc_table[fd].inode_id);
     }
+
+    // Closing a file is a commit point
+    fs_commit();
     return fd;
 }
 
 // ==================== READ ====================
 
-int fs_read(int fd, char *buf, int count)
+// Reads at offset into the pieces of iov one after the other, the cursor of fd stays where it is
+int fs_preadv(int fd, fsIovec *iov, int iovcnt, int offset)
 {
+    if (fd_check(fd) < 0)
+        return -1;
+    int count = iov_total(iov, iovcnt);
+    if (count < 0 || offset < 0)
+    {
+        ERROR_MSG(("Wrong count or offset input!\n"))
+        return -1;
+    }
+
     // Nothing to read bytes case
     if (count == 0)
     {
@@ -225,80 +326,214 @@ int fs_read(int fd, char *buf, int count)
     inode_read(file_desc_table[fd].inode_id, &temporary_file);
 
     int byte_read = 0;
-    if (file_desc_table[fd].cursor >= temporary_file.size)
+    int skip = 0; // Bytes of the first piece of iov already done
+    if (offset >= temporary_file.size)
         return 0;
 
-    // Reading limiter
-    if (file_desc_table[fd].cursor + count > temporary_file.size)
-        count = temporary_file.size - file_desc_table[fd].cursor;
+    // Reading limiter, offset + count may not fit in an int
+    if (count > temporary_file.size - offset)
+        count = temporary_file.size - offset;
 
-    int final_block = (file_desc_table[fd].cursor + count - 1) / NEW_BLOCK_SIZE;
-    int cursor_4_final_block = (file_desc_table[fd].cursor + count - 1) % NEW_BLOCK_SIZE;
+    if (temporary_file.flags & INODE_INLINE) // Contents kept in the inode
+    {
+        iov_copy(&iov, &skip, temporary_file.inline_data + offset, count, 0);
+        return count;
+    }
+    if (temporary_file.flags & INODE_TAIL) // Contents in fragments of a shared block
+    {
+        int block_no;
+        char *data = tail_get(temporary_file.tail, &block_no);
+        iov_copy(&iov, &skip, data + offset, count, 0);
+        dblock_put(block_no, 0);
+        return count;
+    }
+
+    int final_block = (offset + count - 1) / NEW_BLOCK_SIZE;
+    // Reads of a block or more go to the device a run at a time already, smaller ones get readahead
+    if (count < NEW_BLOCK_SIZE)
+        fd_readahead(fd, &temporary_file, offset / NEW_BLOCK_SIZE, final_block);
+    int cursor_4_final_block = (offset + count - 1) % NEW_BLOCK_SIZE;
 
     while (byte_read < count) // Read blocks as necessary to fill buffer
     {
-        int block_live = file_desc_table[fd].cursor / NEW_BLOCK_SIZE;
-        int block_live_id;
-        if (block_live >= DIRECT_BLOCK) // Direct or Id index block
-        {
-            dblock_read(temporary_file.blocks[DIRECT_BLOCK], block_copy);
-
-            uint16_t *block_list = (uint16_t *)block_copy;
-            block_live_id = block_list[block_live - DIRECT_BLOCK];
-        }
-        else
+        while (skip == iov->len) // Pieces done with, or empty
         {
-            block_live_id = temporary_file.blocks[block_live];
+            iov++;
+            skip = 0;
         }
-        dblock_read(block_live_id, block_copy);
+        int block_live = offset / NEW_BLOCK_SIZE;
+        int in_block = offset % NEW_BLOCK_SIZE;
+        int run; // Blocks left in the extent holding block_live
+        int block_live_id = fd_bmap(fd, &temporary_file, block_live, &run);
+        int whole = (count - byte_read) / NEW_BLOCK_SIZE;
+        if (whole > (iov->len - skip) / NEW_BLOCK_SIZE)
+            whole = (iov->len - skip) / NEW_BLOCK_SIZE;
 
         int rdy_count; // Copying bytes block to buff
 
-        if (block_live < final_block)
-            rdy_count = NEW_BLOCK_SIZE - file_desc_table[fd].cursor % NEW_BLOCK_SIZE;
+        if (in_block == 0 && whole > 0) // Whole blocks go to the piece with one request per extent
+        {
+            if (whole > run)
+                whole = run;
+            dblock_read_run(block_live_id, whole, iov->base + skip);
+            rdy_count = whole * NEW_BLOCK_SIZE;
+            skip += rdy_count;
+        }
         else
-            rdy_count = cursor_4_final_block - file_desc_table[fd].cursor % NEW_BLOCK_SIZE + 1;
+        {
+            char *block_data = dblock_get(block_live_id);
+
+            if (block_live < final_block)
+                rdy_count = NEW_BLOCK_SIZE - in_block;
+            else
+                rdy_count = cursor_4_final_block - in_block + 1;
 
-        bcopy((unsigned char *)(block_copy + file_desc_table[fd].cursor % NEW_BLOCK_SIZE), (unsigned char *)buf, rdy_count);
-        buf += rdy_count;
+            iov_copy(&iov, &skip, block_data + in_block, rdy_count, 0);
+            dblock_put(block_live_id, 0);
+        }
         byte_read += rdy_count;
-        file_desc_table[fd].cursor += rdy_count;
+        offset += rdy_count;
     }
     return byte_read;
 }
 
-// ==================== WRITE ====================
+// Reads count bytes at offset, the cursor of fd stays where it is
+int fs_pread(int fd, char *buf, int count, int offset)
+{
+    fsIovec piece = {buf, count};
+    return fs_preadv(fd, &piece, 1, offset);
+}
 
-// writes count bytes to the file referenced by the file descriptor fd of buffer indicated by buf
-int fs_write(int fd, char *buf, int count)
+// Reads at the cursor into the pieces of iov one after the other
+int fs_readv(int fd, fsIovec *iov, int iovcnt)
 {
-    if (count == 0) // Return 0 without any effect
-        return 0;
+    if (fd_check(fd) < 0)
+        return -1;
 
+    int byte_read = fs_preadv(fd, iov, iovcnt, file_desc_table[fd].cursor);
+    if (byte_read > 0)
+        file_desc_table[fd].cursor += byte_read;
+    return byte_read;
+}
+
+int fs_read(int fd, char *buf, int count)
+{
+    fsIovec piece = {buf, count};
+    return fs_readv(fd, &piece, 1);
+}
+
+// ==================== WRITE ====================
+
+// Writes the pieces of iov one after the other at offset, with one inode update and one walk of the
+// block map for all of them. The cursor of fd stays where it is. Bytes between the end of the file and
+// offset read back as zeros.
+int fs_pwritev(int fd, fsIovec *iov, int iovcnt, int offset)
+{
     // Error cases:
-    if (count < 0)
-    {
-        ERROR_MSG(("Wrong count input!\n"))
+    if (fd_check(fd) < 0)
         return -1;
-    }
-    if (fd < 0 || fd >= MAX_FILE_OPEN)
+    int count = iov_total(iov, iovcnt);
+    if (count < 0 || offset < 0)
     {
-        ERROR_MSG(("Wrong fd input!\n"))
+        ERROR_MSG(("Wrong count or offset input!\n"))
         return -1;
     }
 
+    if (count == 0) // Return 0 without any effect
+        return 0;
+
     inode temporary_file_base; // Represent metadata file
     inode_read(file_desc_table[fd].inode_id, &temporary_file_base);
     int temp_size = temporary_file_base.size;
+    int skip = 0; // Bytes of the first piece of iov already done
+
+    // Offsets past MAX_FILE_SIZE can not be expressed
+    if (count > MAX_FILE_SIZE - offset)
+    {
+        if (offset >= MAX_FILE_SIZE)
+        {
+            ERROR_MSG(("File too large.\n"))
+            return 0;
+        }
+        count = MAX_FILE_SIZE - offset;
+    }
+
+    // Files smaller than a block are kept inline or in fragments
+    if (temporary_file_base.flags & (INODE_INLINE | INODE_TAIL))
+    {
+        int small = small_file_reserve(file_desc_table[fd].inode_id, offset + count);
+        if (small < 0)
+        {
+            ERROR_MSG(("No space left.\n"))
+            return 0;
+        }
+        if (small == 0)
+        {
+            inode *node = inode_get(file_desc_table[fd].inode_id);
+            int block_no;
+            char *data = node->inline_data;
+            if (node->flags & INODE_TAIL)
+                data = tail_get(node->tail, &block_no);
+            if (offset > node->size) // Fragments may hold old bytes past the end
+                bzero(data + node->size, offset - node->size);
+            iov_copy(&iov, &skip, data + offset, count, 1);
+            if (node->flags & INODE_TAIL)
+                dblock_put(block_no, 1);
+            offset += count;
+            if (offset > node->size)
+                node->size = offset;
+            inode_put(file_desc_table[fd].inode_id, 1);
+            fs_commit_tick();
+            return count;
+        }
+        inode_read(file_desc_table[fd].inode_id, &temporary_file_base);
+    }
+
+    // Mount data blocks for the part of the write past the blocks the file already has
+    int have_blocks = ((uint32_t)temp_size + NEW_BLOCK_SIZE - 1) / NEW_BLOCK_SIZE;
+    int need_blocks = (offset + count - 1 + NEW_BLOCK_SIZE) / NEW_BLOCK_SIZE;
+    int gap_end = offset / NEW_BLOCK_SIZE; // Blocks before this one are left out of the write
+    int old_blocks = have_blocks; // Blocks from here on are mounted by this write and not zeroed
+    while (have_blocks < need_blocks) // As few extents as the free space allows
+    {
+        int mounted;
+        if (have_blocks < gap_end) // Blocks wholly in a gap past the end only ever read back as zeros
+            mounted = alloc_mount_run(file_desc_table[fd].inode_id, gap_end - have_blocks, NULL, 1);
+        else
+            mounted = alloc_mount_run(file_desc_table[fd].inode_id, need_blocks - have_blocks, NULL, 0);
+        if (mounted < 0)
+            break;
+        have_blocks += mounted;
+    }
+
+    // Out of space: write what fits
+    if (offset + count > have_blocks * NEW_BLOCK_SIZE)
+    {
+        if (offset >= have_blocks * NEW_BLOCK_SIZE)
+        {
+            if (have_blocks > old_blocks) // Give back the blocks mounted for the gap
+            {
+                inode *node = inode_get(file_desc_table[fd].inode_id);
+                for (; have_blocks > old_blocks; have_blocks--)
+                    extent_pop_block(node);
+                inode_put(file_desc_table[fd].inode_id, 1);
+                fd_forget_map(file_desc_table[fd].inode_id);
+            }
+            ERROR_MSG(("No space left.\n"))
+            return 0;
+        }
+        count = have_blocks * NEW_BLOCK_SIZE - offset;
+    }
+    inode_read(file_desc_table[fd].inode_id, &temporary_file_base); // Pick up the mounted blocks
 
     // Block storage space
-    int end_block_num = (file_desc_table[fd].cursor + count - 1 + NEW_BLOCK_SIZE) / NEW_BLOCK_SIZE;
-    int in_end_block_cursor = (file_desc_table[fd].cursor + count - 1) % NEW_BLOCK_SIZE;
+    int end_block_num = (offset + count - 1 + NEW_BLOCK_SIZE) / NEW_BLOCK_SIZE;
+    int in_end_block_cursor = (offset + count - 1) % NEW_BLOCK_SIZE;
 
-    count = (end_block_num - 1) * NEW_BLOCK_SIZE + in_end_block_cursor - file_desc_table[fd].cursor + 1;
+    count = (end_block_num - 1) * NEW_BLOCK_SIZE + in_end_block_cursor - offset + 1;
 
-    if (file_desc_table[fd].cursor + count > temp_size)
-        temporary_file_base.size = file_desc_table[fd].cursor + count;
+    if (offset + count > temp_size)
+        temporary_file_base.size = offset + count;
     else
         temporary_file_base.size = temp_size;
 
@@ -308,46 +543,145 @@ int fs_write(int fd, char *buf, int count)
     int byte_counter = 0;
     while (byte_counter < count)
     {
-        int now_block = file_desc_table[fd].cursor / NEW_BLOCK_SIZE;
-        int now_block_id;
-
-        if (now_block >= DIRECT_BLOCK)
+        while (skip == iov->len) // Pieces done with, or empty
         {
-            dblock_read(temporary_file_base.blocks[DIRECT_BLOCK], block_copy);
-            uint16_t *block_list = (uint16_t *)block_copy;
-            now_block_id = block_list[now_block - DIRECT_BLOCK];
+            iov++;
+            skip = 0;
         }
-
-        else
-        {
-            now_block_id = temporary_file_base.blocks[now_block];
-        }
-        dblock_read(now_block_id, block_copy);
+        int now_block = offset / NEW_BLOCK_SIZE;
+        int run;
+        int now_block_id = fd_bmap(fd, &temporary_file_base, now_block, &run);
+        int in_block = offset % NEW_BLOCK_SIZE;
+        int whole = (count - byte_counter) / NEW_BLOCK_SIZE;
+        if (whole > (iov->len - skip) / NEW_BLOCK_SIZE)
+            whole = (iov->len - skip) / NEW_BLOCK_SIZE;
 
         int to_be_written;
 
-        if (now_block < end_block_num - 1)
-            to_be_written = NEW_BLOCK_SIZE - file_desc_table[fd].cursor % NEW_BLOCK_SIZE;
+        if (in_block == 0 && whole > 0) // Whole blocks go straight from the piece with one request per extent
+        {
+            if (whole > run)
+                whole = run;
+            dblock_write_run(now_block_id, whole, iov->base + skip);
+            to_be_written = whole * NEW_BLOCK_SIZE;
+            skip += to_be_written;
+        }
+        else // Head or tail block, or one the pieces split, merged with what it holds
+        {
+            if (now_block < end_block_num - 1)
+                to_be_written = NEW_BLOCK_SIZE - in_block;
 
-        else
-            to_be_written = in_end_block_cursor - file_desc_table[fd].cursor % NEW_BLOCK_SIZE + 1;
+            else
+                to_be_written = in_end_block_cursor - in_block + 1;
 
-        bcopy((unsigned char *)buf, (unsigned char *)(block_copy + file_desc_table[fd].cursor % NEW_BLOCK_SIZE), to_be_written);
-        dblock_write(now_block_id, block_copy);
+            char *block_data;
+            if (now_block < old_blocks)
+                block_data = dblock_get(now_block_id);
+            else // A new block: nothing to read, and only the bytes this write leaves out need zeroing
+            {
+                block_data = dblock_get_new(now_block_id);
+                bzero(block_data, in_block);
+                bzero(block_data + in_block + to_be_written, NEW_BLOCK_SIZE - in_block - to_be_written);
+            }
 
-        buf = buf + to_be_written;
+            iov_copy(&iov, &skip, block_data + in_block, to_be_written, 1);
+            dblock_put(now_block_id, 1);
+        }
 
         byte_counter = byte_counter + to_be_written;
-        file_desc_table[fd].cursor += to_be_written;
+        offset += to_be_written;
     }
+    fs_commit_tick();
     return byte_counter;
 }
 
+// Writes count bytes of buf at offset, the cursor of fd stays where it is
+int fs_pwrite(int fd, char *buf, int count, int offset)
+{
+    fsIovec piece = {buf, count};
+    return fs_pwritev(fd, &piece, 1, offset);
+}
+
+// Writes the pieces of iov one after the other at the cursor
+int fs_writev(int fd, fsIovec *iov, int iovcnt)
+{
+    if (fd_check(fd) < 0)
+        return -1;
+
+    int byte_counter = fs_pwritev(fd, iov, iovcnt, file_desc_table[fd].cursor);
+    if (byte_counter > 0)
+        file_desc_table[fd].cursor += byte_counter;
+    return byte_counter;
+}
+
+// writes count bytes to the file referenced by the file descriptor fd of buffer indicated by buf
+int fs_write(int fd, char *buf, int count)
+{
+    fsIovec piece = {buf, count};
+    return fs_writev(fd, &piece, 1);
+}
+
+// ==================== SYNC ====================
+
+// Force everything written so far down to the disk image
+int fs_sync(void)
+{
+    fs_checkpoint();
+    return 0;
+}
+
+// ==================== COUNTERS ====================
+
+int fs_counters_read(fs_counters *buf)
+{
+    bcache_stat cache;
+    bcache_stats(&cache);
+
+    buf->cache_hits = cache.hits;
+    buf->cache_misses = cache.misses;
+    buf->cache_writebacks = cache.writebacks;
+    buf->dentry_hits = dcache_hits;
+    buf->dentry_misses = dcache_misses;
+    buf->bloom_rejects = bloom_rejects;
+    buf->readahead_hits = cache.ra_hits;
+    buf->readahead_waste = cache.ra_waste;
+    return 0;
+}
+
 // ==================== SEEK ====================
 
-int fs_lseek(int fd, int offset)
+// Moves the cursor of fd to offset from whence, and returns where it ends up. Moving past the end of
+// the file is fine, a write there leaves a gap of zeros.
+int fs_lseek(int fd, int offset, int whence)
 {
-    return -1;
+    if (fd_check(fd) < 0)
+        return -1;
+
+    int base;
+    if (whence == FS_SEEK_SET)
+        base = 0;
+    else if (whence == FS_SEEK_CUR)
+        base = file_desc_table[fd].cursor;
+    else if (whence == FS_SEEK_END)
+    {
+        inode temporary;
+        inode_read(file_desc_table[fd].inode_id, &temporary);
+        base = temporary.size;
+    }
+    else
+    {
+        ERROR_MSG(("Wrong whence input!\n"))
+        return -1;
+    }
+
+    // Offsets past MAX_FILE_SIZE can not be expressed
+    if ((offset < 0 && base + offset < 0) || (offset > 0 && offset > MAX_FILE_SIZE - base))
+    {
+        ERROR_MSG(("Wrong offset input!\n"))
+        return -1;
+    }
+    file_desc_table[fd].cursor = base + offset;
+    return file_desc_table[fd].cursor;
 }
 
 // ==================== MKDIR ====================
@@ -368,7 +702,7 @@ int fs_mkdir(char *fileName)
     }
 
     // New inode for current directory
-    int created_inode = inode_create(POS_DIRECTORY);
+    int created_inode = inode_create(pwd, POS_DIRECTORY);
     if (created_inode < 0)
         return -1;
 
@@ -388,6 +722,7 @@ int fs_mkdir(char *fileName)
         inode_free(created_inode);
         return -1;
     }
+    fs_commit_tick();
     return created_inode;
 }
 
@@ -395,7 +730,38 @@ int fs_mkdir(char *fileName)
 
 int fs_rmdir(char *fileName)
 {
-    return -1;
+    int target = path_resolve(fileName, pwd, POS_DIRECTORY);
+    if (target < 0)
+    {
+        ERROR_MSG(("%s does not exist.\n", fileName))
+        return -1;
+    }
+
+    inode temporary;
+    inode_read(target, &temporary);
+    if (temporary.type != POS_DIRECTORY)
+    {
+        ERROR_MSG(("%s is not a dir\n", fileName))
+        return -1;
+    }
+
+    char *base_name = path_base_name(fileName);
+    if (target == PWD_ID_ROOT_DIR || target == pwd || base_name[0] == '\0' || same_string(base_name, ".") ||
+        same_string(base_name, ".."))
+    {
+        ERROR_MSG(("Can not remove %s.\n", fileName))
+        return -1;
+    }
+    if (!dir_is_empty(target))
+    {
+        ERROR_MSG(("%s is not empty.\n", fileName))
+        return -1;
+    }
+
+    dir_entry_remove(path_resolve(fileName, pwd, 2), base_name);
+    inode_free(target);
+    fs_commit_tick();
+    return 0;
 }
 // ==================== CD ====================
 
@@ -418,18 +784,88 @@ int fs_cd(char *dirName)
     return 0;
 }
 
-// ==================== NOT IMPLEMENTED ====================
+// ==================== UNLINK ====================
 
-int fs_link(char *old_fileName, char *new_fileName)
+int fs_unlink(char *fileName)
 {
-    return -1;
+    int target = path_resolve(fileName, pwd, REAL_FILE);
+    if (target < 0)
+    {
+        ERROR_MSG(("%s does not exist.\n", fileName))
+        return -1;
+    }
+
+    inode l_inode;
+    inode_read(target, &l_inode);
+    if (l_inode.type == POS_DIRECTORY)
+    {
+        ERROR_MSG(("%s is a dir.\n", fileName))
+        return -1;
+    }
+
+    dir_entry_remove(path_resolve(fileName, pwd, 2), path_base_name(fileName));
+
+    // The inode goes with its last name, or with its last descriptor in fs_close
+    inode *temporary = inode_get(target);
+    temporary->link_count--;
+    int links = temporary->link_count;
+    inode_put(target, 1);
+    if (links == 0 && fd_find_same_num(target) == 0)
+        inode_free(target);
+    fs_commit_tick();
+    return 0;
 }
 
-int fs_unlink(char *fileName)
+// ==================== LINK ====================
+
+// Give the file old_fileName a second name
+int fs_link(char *old_fileName, char *new_fileName)
 {
-    return -1;
+    int target = path_resolve(old_fileName, pwd, REAL_FILE);
+    if (target < 0)
+    {
+        ERROR_MSG(("%s does not exist.\n", old_fileName))
+        return -1;
+    }
+
+    inode l_inode;
+    inode_read(target, &l_inode);
+    if (l_inode.type == POS_DIRECTORY)
+    {
+        ERROR_MSG(("%s is a dir.\n", old_fileName))
+        return -1;
+    }
+
+    int parent = path_resolve(new_fileName, pwd, 2);
+    char *base_name = path_base_name(new_fileName);
+    if (parent < 0 || base_name[0] == '\0')
+    {
+        ERROR_MSG(("Path does not exist.\n"))
+        return -1;
+    }
+    if (strlen(base_name) > MAX_FILE_NAME)
+    {
+        ERROR_MSG(("File name size beyond limit.\n"))
+        return -1;
+    }
+    if (dir_entry_find(parent, base_name) >= 0)
+    {
+        ERROR_MSG(("Name already in use.\n"))
+        return -1;
+    }
+
+    if (add_2_directory_entry(parent, target, base_name) < 0)
+        return -1;
+
+    inode *temporary = inode_get(target);
+    temporary->link_count++;
+    inode_put(target, 1);
+    fs_commit_tick();
+    return 0;
 }
 
+// ==================== NOT IMPLEMENTED ====================
+
 int fs_stat(char *fileName, fileStat *buf)
 {
     return -1;
@@ -440,29 +876,19 @@ int fs_stat(char *fileName, fileStat *buf)
 int fs_ls()
 {
     inode dir_inode;
-    dir_entry dir_entries[NEW_BLOCK_SIZE / sizeof(dir_entry)];
+    dir_entry *entry;
 
     inode_read(pwd, &dir_inode);
 
-    int i, j;
+    int i, off, block_no;
 
-    // printf(".\n");
-    // printf("..\n");
-
-    for (i = 0; i < DIRECT_BLOCK; i++) // Loop for blocks
+    for (i = 0; i < dir_block_count(&dir_inode); i++) // Loop for blocks
     {
-        if (dir_inode.blocks[i] != 0)
-        {
-            dblock_read(dir_inode.blocks[i], (char *)dir_entries); // Read
+        char *records = dir_block_get(&dir_inode, i, &block_no); // Read
 
-            for (j = 0; j < NEW_BLOCK_SIZE / sizeof(dir_entry); j++) // Dir entries
-            {
-                if (dir_entries[j].inode_id != 0)
-                {
-                    printf("%s\n", dir_entries[j].file_name);
-                }
-            }
-        }
+        for (off = 0; (entry = dir_rec_next(records, dir_block_size(&dir_inode), &off)) != NULL;) // Dir entries
+            printf("%.*s\n", entry->name_len, entry->file_name);
+        dir_block_put(block_no, 0);
     }
     return 0;
 }
@@ -3,15 +3,19 @@
 
 // ------------------------------ FILE SYSTEM ------------------------------
 
-#define FS_SIZE 2048
-
 void fs_init(void);
-int fs_mkfs(void);
+int fs_mkfs(fsGeometry *geometry);
 int fs_open(char *fileName, int flags);
 int fs_close(int fd);
 int fs_read(int fd, char *buf, int count);
 int fs_write(int fd, char *buf, int count);
-int fs_lseek(int fd, int offset);
+int fs_pread(int fd, char *buf, int count, int offset);
+int fs_pwrite(int fd, char *buf, int count, int offset);
+int fs_readv(int fd, fsIovec *iov, int iovcnt);
+int fs_writev(int fd, fsIovec *iov, int iovcnt);
+int fs_preadv(int fd, fsIovec *iov, int iovcnt, int offset);
+int fs_pwritev(int fd, fsIovec *iov, int iovcnt, int offset);
+int fs_lseek(int fd, int offset, int whence);
 int fs_mkdir(char *fileName);
 int fs_rmdir(char *fileName);
 int fs_cd(char *dirName);
@@ -19,22 +23,45 @@ int fs_link(char *old_fileName, char *new_fileName);
 int fs_unlink(char *fileName);
 int fs_stat(char *fileName, fileStat *buf);
 int fs_ls();
+int fs_sync(void);
 
 #define MAX_FILE_NAME 32
 #define MAX_PATH_NAME 256
 
 #define MAX_FILE_OPEN 256
 
-#define NEW_BLOCK_SIZE 4096
-#define MAX_FILE_COUNT (2048)
+#define COMMIT_INTERVAL 5 // Seconds between timer commit points
 
-#if (NEW_BLOCK_SIZE * DIRECT_BLOCK + NEW_BLOCK_SIZE * NEW_BLOCK_SIZE / 2) < (DATA_BLOCK_NUMBER * NEW_BLOCK_SIZE)
-#define MAX_FILE_SIZE (NEW_BLOCK_SIZE * DIRECT_BLOCK + NEW_BLOCK_SIZE * NEW_BLOCK_SIZE / 2)
-#else
-#define MAX_FILE_SIZE (DATA_BLOCK_NUMBER * NEW_BLOCK_SIZE)
-#endif
+// ------------------------------ GEOMETRY ------------------------------
+
+// Used by fs_mkfs for the fields of fsGeometry left at 0, and for a blank image
+#define DEFAULT_IMAGE_MB 1
+#define DEFAULT_BLOCK_SIZE 4096
+#define DEFAULT_INODE_COUNT 2048 // Set to 0 to let every group number as many inodes as its bitmap block can
+
+#define MIN_BLOCK_SIZE 4096
+#define MAX_BLOCK_SIZE (64 * 1024)
+#define MAX_IMAGE_MB (1024 * 1024 - 1) // Sector numbers are ints
+#define MAX_DBLOCK_BITMAP (2 * 1024 * 1024) // Bytes, caps the number of data blocks
+#define MAX_INODE_BITMAP MAX_DBLOCK_BITMAP  // Bytes, a group numbers at most a bitmap block of inodes
+
+// Geometry of the mounted fs, worked out from its superblock
+typedef struct
+{
+    int block_size;        // Bytes per fs block
+    int sectors_per_block;
+    int group_count;
+    int inodes_per_group;
+    int data_blocks;       // Blocks managed by the data bitmap
+    int image_sectors;
+} fs_layout;
+
+#define NEW_BLOCK_SIZE (geo.block_size)
+#define SECTORS_PER_BLOCK (geo.sectors_per_block)
+#define MAX_FILE_COUNT (GROUP_COUNT * INODES_PER_GROUP)
 
-#define MAX_FILE_ONE_DIR (DIR_ENTRY_PER_BLOCK * DIRECT_BLOCK + DIR_ENTRY_PER_BLOCK * NEW_BLOCK_SIZE / 2)
+// File offsets are ints in the fs interface
+#define MAX_FILE_SIZE 0x7fffffff
 
 // Bitmap , Dir
 #define INODE_BITMAP 0
@@ -45,32 +72,66 @@ int fs_ls();
 
 // ------------------------------ SUPER BLOCK ------------------------------
 
-#define SUPER_BLOCK 1 // Super Block number
+// The superblock is 4 KiB at byte 4096 whatever the block size, so that it can be found before the
+// geometry is known. The backup takes the last 4 KiB of the image.
+#define SUPER_BLOCK_SIZE 4096
+#define SUPER_BLOCK_SECTOR (4096 / BLOCK_SIZE)
+#define SUPER_BLOCK_SECTORS (SUPER_BLOCK_SIZE / BLOCK_SIZE)
+#define SUPER_BLOCK_BACKUP (geo.image_sectors - SUPER_BLOCK_SECTORS)
 
-#define SUPER_BLOCK_BACKUP (FS_SIZE / 8 - 1)
+// Bits held by one bitmap block
+#define BITS_PER_BLOCK (NEW_BLOCK_SIZE * 8)
 
-// Number of blocks reserved for storing inodes -> 16
-#define INODE_BLOCK_NUMBER (MAX_FILE_COUNT / INODE_PER_BLOCK)
+// Number of blocks managed by the data bitmap, from the first block after the superblock to the last whole
+// group. Group metadata and the backup superblock are marked in use at mkfs.
+#define DATA_BLOCK_NUMBER (geo.data_blocks)
 
-// Number of blocks available for storing data in the file system -> 235
-#define DATA_BLOCK_NUMBER (FS_SIZE / 8 - 5 - INODE_BLOCK_NUMBER)
+// ------------------------------ BLOCK GROUPS ------------------------------
+
+// The data blocks are split into groups, each starting with its data bitmap block, its
+// inode bitmap block, its fragment table and its inode chunk map
+#define BLOCKS_PER_GROUP BITS_PER_BLOCK
+#define GROUP_COUNT (geo.group_count)
+#define MAX_GROUPS 145 // As many as fit in the superblock: 18 GiB with 4 KiB blocks. MAX_DBLOCK_BITMAP
+                       // allows only 32 groups of 64 KiB blocks, 1 TiB
+
+#define INODES_PER_GROUP (geo.inodes_per_group)
+#define GROUP_META_BLOCKS 4
+
+// The inode table of a group is made of chunks of INODE_PER_BLOCK inodes, each one a data block taken
+// when the first of its inodes is allocated. The chunk map of the group lists the data block of each
+// chunk, 0 for the ones not allocated yet.
+#define INODE_CHUNKS (INODES_PER_GROUP / INODE_PER_BLOCK)
+
+typedef struct __attribute__((__packed__))
+{
+    uint32_t dblock_bitmap; // Blocks of the group's metadata
+    uint32_t inode_bitmap;
+    uint32_t frag_table;
+    uint32_t inode_chunks;
+    uint32_t free_blocks;
+    uint32_t free_inodes;
+    uint32_t dir_count; // Directories with their inode in the group
+} group_desc;
 
 //  Padding size required in the super block structure
-#define SB_PADDING (NEW_BLOCK_SIZE - 18)
+#define SB_PADDING (SUPER_BLOCK_SIZE - 36 - MAX_GROUPS * sizeof(group_desc))
 
-// Magic number
-#define MAGIC_NUMBER 01234567
+// Magic number, changed whenever the on-disk format changes
+#define MAGIC_NUMBER 01234601
 
 typedef struct __attribute__((__packed__))
 {
-    uint16_t file_sys_size;
-    uint16_t inode_bitmap_place;
-    uint16_t inode_start;
-    uint16_t inode_count;
+    uint32_t file_sys_size; // Sectors in the image
+    uint32_t block_size;
+    uint32_t inode_count;
     uint32_t magic_num;
-    uint16_t dblock_bitmap_place;
-    uint16_t dblock_start;
-    uint16_t dblock_count;
+    uint32_t dblock_start; // Block of data block 0, where group 0 starts
+    uint32_t dblock_count;
+    uint32_t group_count;
+    uint32_t blocks_per_group;
+    uint32_t inodes_per_group;
+    group_desc groups[MAX_GROUPS];
 
     char _padding[SB_PADDING];
 
@@ -78,56 +139,229 @@ typedef struct __attribute__((__packed__))
 
 // ---------- INODE ------------------------------
 
-#define DIRECT_BLOCK 11
-#define INODE_PADDING 0
+#define INODE_SIZE 128
+#define INODE_EXTENTS 12 // Extents held in the inode itself
+
+#define INODE_PER_BLOCK (NEW_BLOCK_SIZE / INODE_SIZE)
 
-#define INODE_PER_BLOCK (NEW_BLOCK_SIZE / 32)
+// Run of len consecutive data blocks starting at data block start
+typedef struct __attribute__((__packed__))
+{
+    uint32_t start;
+    uint32_t len;
+} extent;
+
+// A file or directory this small keeps its contents in the inode, where the extents would go
+#define INLINE_DATA_SIZE (INODE_EXTENTS * sizeof(extent))
+
+// Inode flags
+#define INODE_INLINE 1 // Contents in inline_data, no data blocks
+#define INODE_TAIL 2   // Contents in the fragments starting at tail, no data blocks of its own
 
-#define MAX_BLOCKS_INDEX_IN_INODE (DIRECT_BLOCK + NEW_BLOCK_SIZE / 2)
+#define MAX_EXTENT_LEN 0x7fffffff
+
+// Extents past the first INODE_EXTENTS live in leaf blocks. With depth 1 the inode points at a
+// single leaf, with depth 2 at a block of leaf pointers, with depth 3 at a block of those.
+#define EXTENTS_PER_BLOCK (NEW_BLOCK_SIZE / 8)
+#define PTRS_PER_BLOCK (NEW_BLOCK_SIZE / 4)
+#define MAX_EXTENT_DEPTH 3
+#define MAX_EXTENTS (INODE_EXTENTS + (uint64_t)EXTENTS_PER_BLOCK * PTRS_PER_BLOCK * PTRS_PER_BLOCK)
 
 typedef struct __attribute__((__packed__))
 {
     uint32_t size; // in bytes
     uint16_t type; // 0 for dir, 1 for file
     uint16_t link_count;
-    uint16_t blocks[DIRECT_BLOCK + 1]; // start from 0 as data block index
+    uint32_t extent_count;         // Runs mapping the file from its first block on
+    uint32_t extent_root;          // Root of the extent tree, valid when extent_depth > 0
+    uint16_t extent_depth;         // Levels of the extent tree, 0 while the inode holds every run
+    uint16_t index_depth;          // Bits of the name hash used by the root of a directory's index
+    uint32_t dir_index;            // Root block of a directory's name index, 0 while the directory fits in one block
+    uint16_t flags;
+    uint16_t _reserved;
+    union
+    {
+        extent extents[INODE_EXTENTS];      // start from 0 as data block index
+        char inline_data[INLINE_DATA_SIZE]; // With INODE_INLINE
+    };
+    uint32_t tail; // With INODE_TAIL, first fragment as data block * FRAGS_PER_BLOCK + fragment
 } inode;
 
+// ---------- INODE CACHE ------------------------------
+
+#define ICACHE_SIZE 128 // Cached inodes
+#define ICACHE_WAYS 4   // Entries per set
+
+typedef struct
+{
+    inode node;
+    int32_t id; // Inode number, -1 when unused
+    uint16_t pin;
+    uint8_t dirty;
+    uint8_t ref;
+    uint8_t release; // Release the chunk of the inode at its last inode_put
+} icache_entry;
+
+// ---------- FRAGMENTS ------------------------------
+
+// A file too big to be inline but smaller than a block keeps its contents in a run of fragments
+// of a block it shares with other such files. Each group lists the fragment blocks it handed out in
+// its fragment table, with a bitmap of the fragments in use for each.
+#define FRAGS_PER_BLOCK 8
+#define FRAG_SIZE (NEW_BLOCK_SIZE / FRAGS_PER_BLOCK)
+
+typedef struct __attribute__((__packed__))
+{
+    uint32_t block; // Data block split in fragments
+    uint8_t map;    // Bit i set when fragment i is in use
+    uint8_t _unused[3];
+} frag_slot;
+
+typedef struct __attribute__((__packed__))
+{
+    uint32_t count; // Slots in use, the first ones
+    uint32_t _unused;
+    frag_slot slots[];
+} frag_table;
+
+#define FRAG_TABLE_SLOTS ((NEW_BLOCK_SIZE - sizeof(frag_table)) / sizeof(frag_slot))
+
 // ---------- DIRECTORY ENTRY ------------------------------
 
 #define PWD_ID_ROOT_DIR 0
 
-#define DIR_ENTRY_PADDING (64 - 2 - MAX_FILE_NAME - 1)
-#define DIR_ENTRY_PER_BLOCK (NEW_BLOCK_SIZE / 64)
+// Records are packed from the start of each directory block, each one rec_len bytes long. A record
+// with rec_len 0, or the end of the block, ends the list: free space is only ever at the end of a block.
+typedef struct __attribute__((__packed__))
+{
+    uint32_t inode_id;
+    uint16_t rec_len;   // Bytes from this record to the next one
+    uint8_t name_len;
+    uint8_t file_type;  // POS_DIRECTORY or REAL_FILE, saves reading the inode
+    uint16_t hash;      // DIR_REC_HASH of the name, compared before the name itself
+    char file_name[];   // name_len bytes, not terminated
+} dir_entry;
+
+// Record size for a name, kept 4 byte aligned
+#define DIR_REC_LEN(name_len) ((sizeof(dir_entry) + (name_len) + 3) & ~3)
+
+// Part of the name hash kept in a record. The index picks buckets with the low bits, so the high
+// ones still tell apart the names of one bucket.
+#define DIR_REC_HASH(hash) ((uint16_t)((hash) >> 16))
+
+// ---------- DIRECTORY INDEX ------------------------------
 
+// Once a directory outgrows its first block its entries are indexed by name hash with extendible
+// hashing. The root block holds 1 << index_depth bucket pointers, picked by the low bits of the hash.
+// A bucket lists the hash and directory block of each entry whose hash ends in its depth low bits,
+// and is split in two when it fills up, doubling the root first if it already uses every bit.
 typedef struct __attribute__((__packed__))
 {
-    uint16_t inode_id;
-    char file_name[MAX_FILE_NAME + 1];
-    char _padding[DIR_ENTRY_PADDING];
+    uint32_t hash;
+    uint32_t block; // Directory block holding the entry
+} dir_index_entry;
 
-} dir_entry;
+typedef struct __attribute__((__packed__))
+{
+    uint16_t depth; // Low hash bits shared by every entry of the bucket
+    uint16_t count;
+    uint32_t _unused;
+    dir_index_entry entries[];
+} dir_index_bucket;
+
+#define DIR_INDEX_PER_BUCKET ((NEW_BLOCK_SIZE - sizeof(dir_index_bucket)) / sizeof(dir_index_entry))
+
+// ---------- DENTRY CACHE ------------------------------
+
+#define DCACHE_SIZE 512 // Cached names
+#define DCACHE_WAYS 4   // Entries per set
+
+// Name of a directory entry and the inode it leads to
+typedef struct
+{
+    int32_t parent; // Directory inode, -1 when unused
+    int32_t child;
+    uint32_t hash;
+    uint8_t ref;
+    char name[MAX_FILE_NAME + 1];
+} dcache_entry;
+
+// ---------- DIRECTORY BLOOM FILTER ------------------------------
+
+// Set bits for the name hashes of a directory, to turn down names it does not hold without reading it.
+// Filters live in memory only and are rebuilt from the directory after a miss.
+#define BLOOM_BITS (64 * 1024) // About 1% false positives with 6500 names
+#define BLOOM_HASHES 3
+#define BLOOM_CACHE 16 // Directories with a filter
+
+typedef struct
+{
+    int32_t dir;    // Directory inode, -1 when unused
+    uint32_t names; // Names added
+    uint32_t stale; // Names removed since, their bits stay set
+    uint8_t ref;
+    uint64_t bits[BLOOM_BITS / 64];
+} dir_bloom;
 
 // ---------- FILE DESCRIPTOR ------------------------------
 
+// Readahead window of a sequential stream, in blocks: it starts at RA_MIN_BLOCKS and doubles with each
+// sequential read up to RA_MAX_BLOCKS, or what bcache_prefetch can read at once if that is less
+#define RA_MIN_BLOCKS 4
+#define RA_MAX_BLOCKS 32
+
 typedef struct
 {
     bool_t is_using; // Boolean for active or inactive
     uint32_t cursor; // File position
-    uint16_t inode_id;
+    uint32_t inode_id;
     uint16_t mode;
 
+    // Mapping cursor, see fd_bmap: run map_index of the file's map holds file blocks from map_base on,
+    // map_len of them starting at data block map_start. Empty while map_len is 0.
+    uint32_t map_index;
+    uint32_t map_base;
+    uint32_t map_start;
+    uint32_t map_len;
+
+    // Readahead, see fd_readahead
+    int32_t ra_last;   // Last file block read, -1 before the first read
+    uint32_t ra_window; // Blocks to keep read ahead of the cursor, 0 for random access
+    uint32_t ra_end;    // File block up to which the cache was filled
+
 } file_desc_structure;
 
+// ---------- COUNTERS ------------------------------
+
+typedef struct
+{
+    uint32_t cache_hits;       // Block lookups served from memory
+    uint32_t cache_misses;     // Block lookups that read the device
+    uint32_t cache_writebacks; // Dirty blocks written to the device
+    uint32_t dentry_hits;      // Name lookups answered by the dentry cache
+    uint32_t dentry_misses;    // Name lookups that searched the directory
+    uint32_t bloom_rejects;    // Missing names turned down by a Bloom filter
+    uint32_t readahead_hits;   // Blocks read ahead and then asked for
+    uint32_t readahead_waste;  // Blocks read ahead and evicted unused
+} fs_counters;
+
+int fs_counters_read(fs_counters *buf);
+
 // ------------------------------------------------------------
 
 #endif
 
 /*
+DEFAULT GEOMETRY, MKFS WITHOUT ARGUMENTS
 FILE SYSTEM = 1MB = 1.048.576 BYTES
-BLOCK SIZE = 512 BYTES
+SECTOR SIZE = 512 BYTES, BLOCK SIZE = 4096 BYTES
+
+SECTORS = 2.048
+BLOCKS = 256, THE FIRST 2 HOLD THE RESERVED SECTORS AND THE SUPERBLOCK
+GROUPS = 1 OF 254 BLOCKS, WITH 2.048 INODES OF 128 BYTES
+GROUP METADATA = 4 BLOCKS, INODE CHUNKS OF 32 INODES TAKEN FROM THE DATA BLOCKS
+BACKUP SUPERBLOCK = LAST BLOCK OF THE IMAGE
+FREE AFTER MKFS = 248 BLOCKS
 
-BLOCKS = 2048 BLOCKS
-INODES = 16 BLOCKS
-DATA = 235 BLOCKS
+LARGER IMAGES COME FROM MKFS <SIZE_MB> [BLOCK_SIZE [INODES]], A GROUP PER 32.768 BLOCKS OF 4096 BYTES
 */
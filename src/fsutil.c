@@ -13,41 +13,256 @@ static void strcpy_limited(char *src, char *dest, int dest_max_len)
 
 // ==================== BLOCK READ WRITE ====================
 
-// Read multiple blocks of data from fs.
-static void adapt_block_read(int block, char *mem)
+// All fs block I/O goes through the buffer cache, which reads and writes whole
+// NEW_BLOCK_SIZE blocks with a single multi-sector request.
+
+// Pin one fs block in the cache and return its contents. Must be released with adapt_block_put.
+static char *adapt_block_get(int block)
 {
-    int i;
-    for (i = 0; i < NEW_BLOCK_SIZE / BLOCK_SIZE; i++)
+    return bcache_get(block);
+}
+
+// Release a block from adapt_block_get, dirty if it was written through the pointer
+static void adapt_block_put(int block, int dirty)
+{
+    bcache_put(block, dirty);
+}
+
+// Clear one fs block
+static void adapt_block_zero(int block)
+{
+    bzero(bcache_get_new(block), NEW_BLOCK_SIZE);
+    adapt_block_put(block, 1);
+}
+
+// ==================== SUPER BLOCK ====================
+
+// Superblock changes stay in memory until the next commit point
+static void sb_mark_dirty(void)
+{
+    sb_dirty = TRUE;
+    sb_backup_dirty = TRUE;
+}
+
+// The superblock copies bypass the buffer cache: they sit at fixed sectors, not on block boundaries
+static void sb_read(int sector)
+{
+    block_read_range(sector, SUPER_BLOCK_SECTORS, super_block_copy);
+}
+
+static void sb_write(int sector)
+{
+    block_write_range(sector, SUPER_BLOCK_SECTORS, super_block_copy);
+}
+
+// ==================== GEOMETRY ====================
+
+// First fs block after the superblock
+static int layout_dblock_start(int block_size)
+{
+    return ((SUPER_BLOCK_SECTOR + SUPER_BLOCK_SECTORS) * BLOCK_SIZE + block_size - 1) / block_size;
+}
+
+// Work out the layout of an image of the given size, in sectors, with its group count and inodes per
+// group. The last group is dropped when it is too short for its metadata. Returns -1 if it does not fit.
+static int layout_fill(fs_layout *l, int image_sectors, int block_size, int group_count, int inodes_per_group)
+{
+    int bits_per_block = block_size * 8;
+
+    if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE || (block_size & (block_size - 1)) != 0)
+        return -1;
+
+    l->block_size = block_size;
+    l->sectors_per_block = block_size / BLOCK_SIZE;
+    l->image_sectors = image_sectors;
+    l->data_blocks = image_sectors / l->sectors_per_block - layout_dblock_start(block_size);
+
+    if (l->data_blocks > group_count * bits_per_block)
+        l->data_blocks = group_count * bits_per_block;
+    if (l->data_blocks - (group_count - 1) * bits_per_block < GROUP_META_BLOCKS + 1)
     {
-        block_read(block * 8 + i, mem + i * BLOCK_SIZE); // Uses block_read
+        group_count--;
+        l->data_blocks = group_count * bits_per_block;
     }
+    l->group_count = group_count;
+    l->inodes_per_group = inodes_per_group;
+
+    if (group_count < 1 || group_count > MAX_GROUPS || group_count * block_size > MAX_DBLOCK_BITMAP)
+        return -1;
+    if (inodes_per_group < 1 || inodes_per_group % (block_size / INODE_SIZE) != 0 || inodes_per_group > bits_per_block)
+        return -1;
+    return 0;
 }
 
-// Adapts to the underlying block size by writing the data in chunks of the appropriate size
-static void adapt_block_write(int block, char *mem)
+// Layout for a new image, with inodes spread evenly over the groups. An inode count of 0 lets every
+// group number as many inodes as its bitmap block can.
+static int layout_make(fs_layout *l, int image_mb, int block_size, int inode_count)
 {
-    int i;
-    for (i = 0; i < NEW_BLOCK_SIZE / BLOCK_SIZE; i++)
+    if (image_mb < 1 || image_mb > MAX_IMAGE_MB || block_size < MIN_BLOCK_SIZE || inode_count < 0)
+        return -1;
+
+    int image_sectors = image_mb * (1024 * 1024 / BLOCK_SIZE);
+    int blocks = image_sectors / (block_size / BLOCK_SIZE) - layout_dblock_start(block_size);
+    int group_count = (blocks + block_size * 8 - 1) / (block_size * 8);
+    int inode_per_block = block_size / INODE_SIZE;
+    int inodes_per_group = inode_count ? (inode_count + group_count - 1) / group_count : block_size * 8;
+
+    inodes_per_group = (inodes_per_group + inode_per_block - 1) / inode_per_block * inode_per_block;
+    return layout_fill(l, image_sectors, block_size, group_count, inodes_per_group);
+}
+
+// Take the geometry from the superblock copy. Returns -1 if it does not hold a valid superblock.
+static int layout_load(void)
+{
+    fs_layout l;
+
+    if (created_super_block->magic_num != MAGIC_NUMBER)
+        return -1;
+    if (layout_fill(&l, created_super_block->file_sys_size, created_super_block->block_size,
+                    created_super_block->group_count, created_super_block->inodes_per_group) < 0 ||
+        l.group_count != created_super_block->group_count)
+        return -1;
+    geo = l;
+    return 0;
+}
+
+// ==================== BLOCK GROUPS ====================
+
+static group_desc *group_get(int g)
+{
+    return &created_super_block->groups[g];
+}
+
+// Bits per group in the inode (0) or data (1) bitmap
+static int group_bits(int inode_or_dt)
+{
+    return inode_or_dt ? BLOCKS_PER_GROUP : INODES_PER_GROUP;
+}
+
+// Group an inode or a data block belongs to
+static int group_of(int inode_or_dt, int index)
+{
+    return index / group_bits(inode_or_dt);
+}
+
+// Free inodes or data blocks left in a group
+static uint32_t group_free(int inode_or_dt, int g)
+{
+    return inode_or_dt ? group_get(g)->free_blocks : group_get(g)->free_inodes;
+}
+
+static void group_free_add(int inode_or_dt, int g, int delta)
+{
+    if (inode_or_dt)
+        group_get(g)->free_blocks += delta;
+    else
+        group_get(g)->free_inodes += delta;
+    sb_mark_dirty();
+}
+
+// First data block of a group past its metadata, where its files' data starts
+static int group_data_start(int g)
+{
+    return g * BLOCKS_PER_GROUP + GROUP_META_BLOCKS;
+}
+
+// ==================== BITMAP FOR INODE OR DATA ====================
+
+// Block holding the inode (0) or data (1) bitmap of a group
+static int bitmap_place(int inode_or_dt, int g)
+{
+    if (inode_or_dt)
+        return group_get(g)->dblock_bitmap;
+    return group_get(g)->inode_bitmap;
+}
+
+// Sectors of a group bitmap block holding its bits
+static int bitmap_sectors(int inode_or_dt)
+{
+    return (group_bits(inode_or_dt) / 8 + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+// Nothing of the bitmap waits to be written
+static void bitmap_clean(int inode_or_dt)
+{
+    int g;
+    for (g = 0; g < GROUP_COUNT; g++)
+    {
+        bitmap_dirty_lo[inode_or_dt][g] = bitmap_sectors(inode_or_dt);
+        bitmap_dirty_hi[inode_or_dt][g] = 0;
+    }
+}
+
+// Scratch for group bitmaps that do not end on a sector boundary, and so are packed closer in memory than on disk
+static char bitmap_scratch[MAX_BLOCK_SIZE];
+
+// Load the bitmap blocks of every group into their copies. They never go through the buffer cache.
+static void bitmap_load(void)
+{
+    int i, g;
+    for (i = INODE_BITMAP; i <= DBLOCK_BITMAP; i++)
     {
-        block_write(block * 8 + i, mem + i * BLOCK_SIZE);
+        int bytes = group_bits(i) / 8;
+        for (g = 0; g < GROUP_COUNT; g++)
+        {
+            int first_sector = bitmap_place(i, g) * SECTORS_PER_BLOCK;
+            if (bytes % BLOCK_SIZE != 0)
+            {
+                block_read_range(first_sector, bitmap_sectors(i), bitmap_scratch);
+                bcopy((unsigned char *)bitmap_scratch, (unsigned char *)(bitmap[i] + g * bytes), bytes);
+            }
+            else
+                block_read_range(first_sector, bitmap_sectors(i), bitmap[i] + g * bytes);
+        }
+        bitmap_clean(i);
     }
 }
 
-static void sb_write()
+// Start both bitmaps empty, all of it to be written at the next commit
+static void bitmap_reset(void)
 {
-    adapt_block_write(SUPER_BLOCK, super_block_copy);
-    adapt_block_write(SUPER_BLOCK_BACKUP, super_block_copy);
+    int i, g;
+    for (i = INODE_BITMAP; i <= DBLOCK_BITMAP; i++)
+    {
+        bzero(bitmap[i], GROUP_COUNT * group_bits(i) / 8);
+        for (g = 0; g < GROUP_COUNT; g++)
+        {
+            bitmap_dirty_lo[i][g] = 0;
+            bitmap_dirty_hi[i][g] = bitmap_sectors(i);
+        }
+    }
 }
 
-// ==================== BITMAP FOR INODE OR DATA ====================
+// Write only the sectors of the group bitmaps that changed since the last commit
+static void bitmap_commit(int inode_or_dt)
+{
+    int bytes = group_bits(inode_or_dt) / 8;
+    int g;
+
+    for (g = 0; g < GROUP_COUNT; g++)
+    {
+        int lo = bitmap_dirty_lo[inode_or_dt][g];
+        int hi = bitmap_dirty_hi[inode_or_dt][g];
+        int first_sector = bitmap_place(inode_or_dt, g) * SECTORS_PER_BLOCK;
+        char *bits = bitmap[inode_or_dt] + g * bytes;
+
+        if (lo >= hi)
+            continue;
+        if (bytes % BLOCK_SIZE != 0)
+        {
+            bzero(bitmap_scratch, bitmap_sectors(inode_or_dt) * BLOCK_SIZE);
+            bcopy((unsigned char *)bits, (unsigned char *)bitmap_scratch, bytes);
+            bits = bitmap_scratch;
+        }
+        block_write_range(first_sector + lo, hi - lo, bits + lo * BLOCK_SIZE);
+    }
+    bitmap_clean(inode_or_dt);
+}
 
+// Set or clear one bit, keeping the free count of its group in step
 static void write_bitmap_block(int inode_or_dt, int index, int val) // 0 for inode bitmap,1 for data bitmap
 {
-    char *bitmap_block_scratch;
-    if (inode_or_dt)
-        bitmap_block_scratch = dblock_bitmap_block_copy;
-    else
-        bitmap_block_scratch = inode_bitmap_block_copy;
+    char *bitmap_block_scratch = bitmap[inode_or_dt];
 
     int byte_index = index / 8; // Byte index calc
     uint8_t the_byte = bitmap_block_scratch[byte_index];
@@ -55,28 +270,66 @@ static void write_bitmap_block(int inode_or_dt, int index, int val) // 0 for ino
     int mask_off = index % 8; // Bit offset within byte
     uint8_t mask = 1 << mask_off;
 
+    int g = group_of(inode_or_dt, index);
+    if (((the_byte & mask) != 0) != (val != 0))
+        group_free_add(inode_or_dt, g, val ? -1 : 1);
+
     the_byte = the_byte & (~mask); // Set or clear bit
     if (val)
         the_byte = the_byte | mask;
 
     bitmap_block_scratch[byte_index] = the_byte; // Update
 
-    // Write the modified bitmap block back to the corresponding location
-    if (inode_or_dt)
-        adapt_block_write(created_super_block->dblock_bitmap_place, bitmap_block_scratch);
-    else
-        adapt_block_write(created_super_block->inode_bitmap_place, bitmap_block_scratch);
+    // Remember which sectors of the group block need writing at the next commit
+    int sector = (index % group_bits(inode_or_dt)) / 8 / BLOCK_SIZE;
+    if (sector < bitmap_dirty_lo[inode_or_dt][g])
+        bitmap_dirty_lo[inode_or_dt][g] = sector;
+    if (sector + 1 > bitmap_dirty_hi[inode_or_dt][g])
+        bitmap_dirty_hi[inode_or_dt][g] = sector + 1;
 }
 
-static int read_bitmap_block(int inode_or_dt, int index) // 0 for inode bitmap,1 for data bitmap
+// Describe every group in the superblock and reserve their metadata blocks, and the backup
+// superblock, in the freshly reset data bitmap
+static void group_init(void)
 {
-    char *bitmap_block_scratch;
+    int g, i;
 
-    if (inode_or_dt)
-        bitmap_block_scratch = dblock_bitmap_block_copy; // Assign the data bitmap block copy
+    created_super_block->group_count = GROUP_COUNT;
+    created_super_block->blocks_per_group = BLOCKS_PER_GROUP;
+    created_super_block->inodes_per_group = INODES_PER_GROUP;
 
-    else
-        bitmap_block_scratch = inode_bitmap_block_copy; // Assign the inode bitmap block copy
+    for (g = 0; g < GROUP_COUNT; g++)
+    {
+        group_desc *desc = group_get(g);
+        int first = created_super_block->dblock_start + g * BLOCKS_PER_GROUP;
+        int blocks = DATA_BLOCK_NUMBER - g * BLOCKS_PER_GROUP;
+
+        desc->dblock_bitmap = first;
+        desc->inode_bitmap = first + 1;
+        desc->frag_table = first + 2;
+        desc->inode_chunks = first + 3;
+        desc->free_blocks = blocks < BLOCKS_PER_GROUP ? blocks : BLOCKS_PER_GROUP;
+        desc->free_inodes = INODES_PER_GROUP;
+        desc->dir_count = 0;
+
+        for (i = 0; i < GROUP_META_BLOCKS; i++)
+            write_bitmap_block(DBLOCK_BITMAP, g * BLOCKS_PER_GROUP + i, 1);
+        adapt_block_zero(desc->frag_table); // No fragment blocks yet
+        adapt_block_zero(desc->inode_chunks); // Nor inode chunks
+        created_super_block->dblock_count += GROUP_META_BLOCKS;
+    }
+
+    int backup = SUPER_BLOCK_BACKUP / SECTORS_PER_BLOCK - created_super_block->dblock_start;
+    if (backup < DATA_BLOCK_NUMBER)
+    {
+        write_bitmap_block(DBLOCK_BITMAP, backup, 1);
+        created_super_block->dblock_count++;
+    }
+}
+
+static int read_bitmap_block(int inode_or_dt, int index) // 0 for inode bitmap,1 for data bitmap
+{
+    char *bitmap_block_scratch = bitmap[inode_or_dt];
 
     int byte_index = index / 8; // Byte index
     uint8_t the_byte = bitmap_block_scratch[byte_index];
@@ -89,135 +342,1377 @@ static int read_bitmap_block(int inode_or_dt, int index) // 0 for inode bitmap,1
 
 // ==================== DATA BLOCK READ WRITE FREE ====================
 
-static void dblock_read(int index, char *block_buff)
-{
-    adapt_block_read(created_super_block->dblock_start + index, block_buff);
+// Pin a data block in the cache, see adapt_block_get
+static char *dblock_get(int index)
+{
+    return adapt_block_get(created_super_block->dblock_start + index);
+}
+
+// Pin a data block the caller is about to fill, without reading what it held
+static char *dblock_get_new(int index)
+{
+    return bcache_get_new(created_super_block->dblock_start + index);
+}
+
+static void dblock_put(int index, int dirty)
+{
+    adapt_block_put(created_super_block->dblock_start + index, dirty);
+}
+
+// Copy count consecutive data blocks into mem, reading the ones not cached in as few requests as possible
+static void dblock_read_run(int index, int count, char *mem)
+{
+    bcache_read_range(created_super_block->dblock_start + index, count, mem);
+}
+
+// Write count consecutive data blocks from mem, the ones not cached straight to the device
+static void dblock_write_run(int index, int count, char *mem)
+{
+    bcache_write_range(created_super_block->dblock_start + index, count, mem);
+}
+
+static void dblock_free(int index)
+{
+    int temp = read_bitmap_block(DBLOCK_BITMAP, index);
+    if (temp)
+    {
+        created_super_block->dblock_count--; // Decrease count
+        sb_mark_dirty();
+    }
+    write_bitmap_block(DBLOCK_BITMAP, index, 0);
+}
+
+// ==================== FIND AVAILABLE ====================
+
+// Number of bits in use in the inode (0) or data (1) bitmap
+static int bitmap_bits(int inode_or_dt)
+{
+    if (inode_or_dt)
+        return DATA_BLOCK_NUMBER;
+    return MAX_FILE_COUNT;
+}
+
+// 64 bit word w of a bitmap, with the bits past the end of the map reading as used.
+// Bit i of the bitmap is bit i % 64 of word i / 64 on a little-endian machine.
+static uint64_t bitmap_word(int inode_or_dt, int w)
+{
+    uint64_t word = ((uint64_t *)bitmap[inode_or_dt])[w];
+    int valid = bitmap_bits(inode_or_dt) - w * 64;
+
+    if (valid < 64)
+        word |= ~0ULL << valid;
+    return word;
+}
+
+// First free bit in [from, end), or -1. Groups with nothing free are skipped without looking at their bits.
+static int bitmap_next_free(int inode_or_dt, int from, int end)
+{
+    while (from < end)
+    {
+        if (group_free(inode_or_dt, group_of(inode_or_dt, from)) == 0)
+        {
+            from = (group_of(inode_or_dt, from) + 1) * group_bits(inode_or_dt);
+            continue;
+        }
+        uint64_t free_bits = ~bitmap_word(inode_or_dt, from / 64) & (~0ULL << (from % 64));
+        if (free_bits != 0)
+        {
+            int bit = from / 64 * 64 + __builtin_ctzll(free_bits);
+            return bit < end ? bit : -1;
+        }
+        from = (from / 64 + 1) * 64;
+    }
+    return -1;
+}
+
+// Number of consecutive free bits starting at bit, at most max
+static int bitmap_run_length(int inode_or_dt, int bit, int max)
+{
+    int n = 0;
+    while (n < max && bit + n < bitmap_bits(inode_or_dt))
+    {
+        int off = (bit + n) % 64;
+        uint64_t used = bitmap_word(inode_or_dt, (bit + n) / 64) >> off;
+        if (used != 0)
+        {
+            n += __builtin_ctzll(used);
+            break;
+        }
+        n += 64 - off;
+    }
+    return n < max ? n : max;
+}
+
+// Find a free run of want bits, going round the bitmap once from start, so the first one found is the
+// closest after start. Settles for the longest run seen when there is none that long.
+// Returns its first bit and sets *len, or -1.
+static int find_available_run(int inode_or_dt, int start, int want, int *len)
+{
+    int best = -1, best_len = 0;
+    int pass;
+
+    for (pass = 0; pass < 2 && best_len < want; pass++)
+    {
+        int pos = pass ? 0 : start;
+        int end = pass ? start : bitmap_bits(inode_or_dt);
+
+        while (best_len < want && (pos = bitmap_next_free(inode_or_dt, pos, end)) >= 0)
+        {
+            int n = bitmap_run_length(inode_or_dt, pos, want);
+            if (n > best_len)
+            {
+                best = pos;
+                best_len = n;
+            }
+            pos += n;
+        }
+    }
+
+    *len = best_len;
+    return best;
+}
+
+// ==================== DATA BLOCK ALLOCATION ====================
+
+// Allocate up to want contiguous data blocks, starting at goal when it is free so that a file keeps growing in place,
+// else as close after it as possible. Without a goal (-1) the search goes on from the last allocation.
+// The blocks are zeroed with zero set, else left as they are for a caller about to write over them.
+// Returns the first one and sets *len, or -1 when the disk is full.
+static int dblock_alloc_run(int goal, int want, int *len, int zero)
+{
+    int start, i;
+
+    if (goal < 0 || goal >= DATA_BLOCK_NUMBER)
+        goal = (dblock_bitmap_last + 1) % DATA_BLOCK_NUMBER;
+
+    if (!read_bitmap_block(DBLOCK_BITMAP, goal))
+    {
+        start = goal;
+        *len = bitmap_run_length(DBLOCK_BITMAP, goal, want);
+    }
+    else
+        start = find_available_run(DBLOCK_BITMAP, goal, want, len);
+
+    if (start < 0)
+    {
+        ERROR_MSG(("Impossible to alloc."))
+        return -1;
+    }
+    dblock_bitmap_last = start + *len - 1; // Update last allc
+
+    for (i = start; i < start + *len; i++)
+    {
+        write_bitmap_block(DBLOCK_BITMAP, i, 1);
+        if (zero)
+            adapt_block_zero(created_super_block->dblock_start + i);
+    }
+    created_super_block->dblock_count += *len;
+    sb_mark_dirty();
+    return start;
+}
+
+// ==================== INODE INIT READ ALLOC WRITE FREE ====================
+
+// Initializing an inode structure
+static void inode_init(inode *prop, int type)
+{
+    // Initializes an inode structure by setting its properties
+    prop->size = 0;
+    prop->type = type;
+    prop->link_count = 1;
+    // Clears the extent map of the inode
+    prop->extent_count = 0;
+    prop->extent_root = 0;
+    prop->extent_depth = 0;
+    bzero((char *)prop->extents, sizeof(extent) * INODE_EXTENTS);
+    prop->index_depth = 0;
+    prop->dir_index = 0;
+    // Contents start out inline, a directory takes the whole area for its records
+    prop->flags = INODE_INLINE;
+    if (type == POS_DIRECTORY)
+        prop->size = INLINE_DATA_SIZE;
+}
+
+// ==================== INODE CACHE ====================
+
+// Entry of the chunk map of its group for the chunk holding an inode, pinned until inode_chunk_put
+static uint32_t *inode_chunk_get(int index)
+{
+    int g = group_of(INODE_BITMAP, index);
+    uint32_t *map = (uint32_t *)adapt_block_get(group_get(g)->inode_chunks);
+    return &map[(index % INODES_PER_GROUP) / INODE_PER_BLOCK];
+}
+
+static void inode_chunk_put(int index, int dirty)
+{
+    adapt_block_put(group_get(group_of(INODE_BITMAP, index))->inode_chunks, dirty);
+}
+
+// Inode table block holding an inode
+static int inode_table_block(int index)
+{
+    int block = *inode_chunk_get(index);
+    inode_chunk_put(index, 0);
+    FS_ASSERT(block != 0); // The chunk has no table block yet
+    return created_super_block->dblock_start + block;
+}
+
+// Drop every cached inode, used when the fs underneath changes
+static void icache_init(void)
+{
+    int i;
+    for (i = 0; i < ICACHE_SIZE; i++)
+    {
+        inode_cache[i].id = -1;
+        inode_cache[i].pin = 0;
+        inode_cache[i].dirty = 0;
+        inode_cache[i].release = 0;
+    }
+}
+
+// Write every dirty inode living in the inode table block of inode index with a single block update
+static void icache_writeback_block(int index)
+{
+    int i, table_block = inode_table_block(index);
+    inode *inode_block_scratch = (inode *)adapt_block_get(table_block);
+
+    for (i = 0; i < ICACHE_SIZE; i++)
+        if (inode_cache[i].dirty && inode_cache[i].id / INODE_PER_BLOCK == index / INODE_PER_BLOCK)
+        {
+            inode_block_scratch[inode_cache[i].id % INODE_PER_BLOCK] = inode_cache[i].node;
+            inode_cache[i].dirty = 0;
+        }
+    adapt_block_put(table_block, 1);
+}
+
+// Push all dirty inodes down to their table blocks
+static void icache_flush(void)
+{
+    int i;
+    for (i = 0; i < ICACHE_SIZE; i++)
+        if (inode_cache[i].dirty)
+            icache_writeback_block(inode_cache[i].id);
+}
+
+// First entry of the set an inode maps to
+static int icache_set(int index)
+{
+    return (index % (ICACHE_SIZE / ICACHE_WAYS)) * ICACHE_WAYS;
+}
+
+// Pin inode index in the cache and return it, loading it from the inode table unless fill is 0
+static inode *icache_get(int index, int fill)
+{
+    int set = icache_set(index);
+    int i, victim = -1;
+
+    for (i = set; i < set + ICACHE_WAYS; i++)
+        if (inode_cache[i].id == index)
+        {
+            inode_cache[i].pin++;
+            inode_cache[i].ref = 1;
+            return &inode_cache[i].node;
+        }
+
+    // Second chance within the set, skipping pinned entries
+    for (i = 0; i < 2 * ICACHE_WAYS && victim < 0; i++)
+    {
+        icache_entry *entry = &inode_cache[set + i % ICACHE_WAYS];
+        if (entry->pin)
+            continue;
+        if (entry->id >= 0 && entry->ref)
+            entry->ref = 0;
+        else
+            victim = set + i % ICACHE_WAYS;
+    }
+    FS_ASSERT(victim >= 0); // Every entry of the set is pinned
+
+    icache_entry *entry = &inode_cache[victim];
+    if (entry->dirty)
+        icache_writeback_block(entry->id);
+
+    entry->id = index;
+    entry->pin = 1;
+    entry->ref = 1;
+    entry->dirty = 0;
+    entry->release = 0;
+    if (fill)
+    {
+        int table_block = inode_table_block(index);
+        inode *inode_block_scratch = (inode *)adapt_block_get(table_block);
+        entry->node = inode_block_scratch[index % INODE_PER_BLOCK];
+        adapt_block_put(table_block, 0);
+    }
+    return &entry->node;
+}
+
+// Give the table block of the chunk holding inode index back to the data blocks once none of its inodes
+// is in use. Cached copies of them go too; while one is still pinned the release waits for its inode_put.
+static void inode_chunk_release(int index)
+{
+    int first = index / INODE_PER_BLOCK * INODE_PER_BLOCK;
+    int i;
+
+    if (bitmap_run_length(INODE_BITMAP, first, INODE_PER_BLOCK) < INODE_PER_BLOCK)
+        return;
+    for (i = 0; i < ICACHE_SIZE; i++)
+        if (inode_cache[i].id >= 0 && inode_cache[i].id / INODE_PER_BLOCK == index / INODE_PER_BLOCK &&
+            inode_cache[i].pin)
+        {
+            inode_cache[i].release = 1;
+            return;
+        }
+    for (i = 0; i < ICACHE_SIZE; i++)
+        if (inode_cache[i].id >= 0 && inode_cache[i].id / INODE_PER_BLOCK == index / INODE_PER_BLOCK)
+        {
+            inode_cache[i].id = -1;
+            inode_cache[i].dirty = 0;
+        }
+
+    uint32_t *chunk = inode_chunk_get(index);
+    dblock_free(*chunk);
+    *chunk = 0;
+    inode_chunk_put(index, 1);
+}
+
+// Pin an inode, see inode_put
+static inode *inode_get(int index)
+{
+    return icache_get(index, 1);
+}
+
+// Unpin an inode from inode_get, dirty if the caller modified it
+static void inode_put(int index, int dirty)
+{
+    int i, set = icache_set(index);
+    for (i = set; i < set + ICACHE_WAYS; i++)
+        if (inode_cache[i].id == index)
+        {
+            inode_cache[i].pin--;
+            if (dirty)
+                inode_cache[i].dirty = 1;
+            if (inode_cache[i].pin == 0 && inode_cache[i].release)
+            {
+                inode_cache[i].release = 0;
+                inode_chunk_release(index);
+            }
+            return;
+        }
+}
+
+// Write an inode to a specific index in the inode block
+static void inode_write(int index, inode *inode_buff)
+{
+    inode *cached = icache_get(index, 0);
+    *cached = *inode_buff;
+    inode_put(index, 1);
+}
+
+// Read inodes from a fs for various operations
+static void inode_read(int index, inode *inode_buff)
+{
+    inode *cached = inode_get(index);
+    *inode_buff = *cached;
+    inode_put(index, 0);
+}
+
+// Give the chunk holding inode index its table block, a zeroed data block as close to the start of the
+// group as possible, unless it has one already. Returns -1 when the disk is full.
+static int inode_chunk_alloc(int index)
+{
+    uint32_t *chunk = inode_chunk_get(index);
+    int len;
+
+    if (*chunk != 0)
+    {
+        inode_chunk_put(index, 0);
+        return 0;
+    }
+    int block = dblock_alloc_run(group_data_start(group_of(INODE_BITMAP, index)), 1, &len, 1);
+    if (block < 0)
+    {
+        inode_chunk_put(index, 0);
+        return -1;
+    }
+    *chunk = block;
+    inode_chunk_put(index, 1);
+    return 0;
+}
+
+// Group for a new directory: one with at least the average number of free inodes, preferring free blocks
+// and then few directories, so that directories spread out and their files have room around them
+static int group_for_dir(void)
+{
+    int g, best = -1;
+    uint32_t avg_free = (MAX_FILE_COUNT - created_super_block->inode_count) / GROUP_COUNT;
+
+    for (g = 0; g < GROUP_COUNT; g++)
+    {
+        group_desc *desc = group_get(g);
+        if (desc->free_inodes == 0 || desc->free_inodes < avg_free)
+            continue;
+        if (best < 0 || desc->free_blocks > group_get(best)->free_blocks ||
+            (desc->free_blocks == group_get(best)->free_blocks && desc->dir_count < group_get(best)->dir_count))
+            best = g;
+    }
+    return best;
+}
+
+// Group for a new file: the one of its directory when there is room, else a quadratic probe
+// from there, else any group with a free inode
+static int group_for_file(int parent)
+{
+    int parent_group = group_of(INODE_BITMAP, parent);
+    int g, step;
+
+    if (group_get(parent_group)->free_inodes > 0 && group_get(parent_group)->free_blocks > 0)
+        return parent_group;
+
+    for (step = 1, g = parent_group; step < GROUP_COUNT; step <<= 1)
+    {
+        g = (g + step) % GROUP_COUNT;
+        if (group_get(g)->free_inodes > 0 && group_get(g)->free_blocks > 0)
+            return g;
+    }
+
+    for (g = 0; g < GROUP_COUNT; g++)
+        if (group_get(g)->free_inodes > 0)
+            return g;
+    return -1;
+}
+
+// Allocate an inode for a new entry of directory parent, placed by group_for_dir / group_for_file
+static int inode_alloc(int parent, int type)
+{
+    int g = type == POS_DIRECTORY ? group_for_dir() : group_for_file(parent);
+    if (g < 0)
+        g = group_for_file(parent); // Only groups below the average are left
+    if (g < 0)
+        return -1;
+
+    // Find the first free inode of the group in the inode bitmap
+    int searched = bitmap_next_free(INODE_BITMAP, g * INODES_PER_GROUP, (g + 1) * INODES_PER_GROUP);
+
+    if (searched >= 0 && inode_chunk_alloc(searched) == 0) // Free inode found, with a table block for it
+    {
+        write_bitmap_block(INODE_BITMAP, searched, 1);
+        created_super_block->inode_count++; // Allocation counter added
+        if (type == POS_DIRECTORY)
+            group_get(g)->dir_count++;
+        sb_mark_dirty();
+
+        return searched;
+    }
+    return -1;
+}
+
+static int inode_create(int parent, int type)
+{
+    inode inode_copy; // Inode structure hold new inode info
+    int i_allocated_index;
+
+    i_allocated_index = inode_alloc(parent, type);
+
+    if (i_allocated_index < 0) // Fail
+    {
+        return -1;
+    }
+    inode_init(&inode_copy, type);
+    inode_write(i_allocated_index, &inode_copy);
+
+    return i_allocated_index;
+}
+
+// ==================== TAIL FRAGMENTS ====================
+
+// Fragments holding size bytes of a file kept in fragments
+static int tail_frags(int size)
+{
+    return (size + FRAG_SIZE - 1) / FRAG_SIZE;
+}
+
+// Contents of the fragments starting at tail, pinned until dblock_put(*block_no)
+static char *tail_get(uint32_t tail, int *block_no)
+{
+    *block_no = tail / FRAGS_PER_BLOCK;
+    return dblock_get(*block_no) + tail % FRAGS_PER_BLOCK * FRAG_SIZE;
+}
+
+// Bits for count fragments from frag on
+static uint8_t frag_mask(int frag, int count)
+{
+    return ((1u << count) - 1) << frag;
+}
+
+static frag_table *frag_table_get(int g)
+{
+    return (frag_table *)adapt_block_get(group_get(g)->frag_table);
+}
+
+static void frag_table_put(int g, int dirty)
+{
+    adapt_block_put(group_get(g)->frag_table, dirty);
+}
+
+// Slot of the fragment table describing a data block, or -1
+static int frag_slot_find(frag_table *table, int block)
+{
+    int i;
+    for (i = 0; i < table->count; i++)
+        if (table->slots[i].block == block)
+            return i;
+    return -1;
+}
+
+// Take count consecutive fragments in group g, from the fragment block with the fewest free ones that has
+// such a run, or from a new fragment block when none has. Returns the first one, or -1 when the group
+// has no room left in its fragment table or the disk is full.
+static int frag_alloc(int g, int count)
+{
+    frag_table *table = frag_table_get(g);
+    int best = -1, best_frag = 0, best_free = FRAGS_PER_BLOCK + 1;
+    int i, frag, len;
+
+    for (i = 0; i < table->count; i++)
+    {
+        uint8_t map = table->slots[i].map;
+        int spare = FRAGS_PER_BLOCK - __builtin_popcount(map);
+        if (spare < count || spare >= best_free)
+            continue;
+        for (frag = 0; frag + count <= FRAGS_PER_BLOCK; frag++)
+            if ((map & frag_mask(frag, count)) == 0)
+            {
+                best = i;
+                best_frag = frag;
+                best_free = spare;
+                break;
+            }
+    }
+
+    if (best < 0)
+    {
+        if (table->count >= FRAG_TABLE_SLOTS)
+        {
+            frag_table_put(g, 0);
+            return -1;
+        }
+        int block = dblock_alloc_run(group_data_start(g), 1, &len, 1);
+        if (block < 0)
+        {
+            frag_table_put(g, 0);
+            return -1;
+        }
+        best = table->count++;
+        table->slots[best].block = block;
+        table->slots[best].map = 0;
+        best_frag = 0;
+    }
+
+    table->slots[best].map |= frag_mask(best_frag, count);
+    int first = table->slots[best].block * FRAGS_PER_BLOCK + best_frag;
+    frag_table_put(g, 1);
+    return first;
+}
+
+// Grow the run of have fragments starting at first to want fragments without moving it. Returns -1 if
+// the fragments after it are taken.
+static int frag_grow(int g, uint32_t first, int have, int want)
+{
+    int frag = first % FRAGS_PER_BLOCK;
+    if (frag + want > FRAGS_PER_BLOCK)
+        return -1;
+
+    frag_table *table = frag_table_get(g);
+    int slot = frag_slot_find(table, first / FRAGS_PER_BLOCK);
+    uint8_t more = frag_mask(frag + have, want - have);
+
+    if (slot < 0 || (table->slots[slot].map & more) != 0)
+    {
+        frag_table_put(g, 0);
+        return -1;
+    }
+    table->slots[slot].map |= more;
+    frag_table_put(g, 1);
+    return 0;
+}
+
+// Give back count fragments starting at first. A fragment block left empty goes back to the data bitmap.
+static void frag_free(int g, uint32_t first, int count)
+{
+    frag_table *table = frag_table_get(g);
+    int slot = frag_slot_find(table, first / FRAGS_PER_BLOCK);
+
+    if (slot < 0)
+    {
+        frag_table_put(g, 0);
+        return;
+    }
+    table->slots[slot].map &= ~frag_mask(first % FRAGS_PER_BLOCK, count);
+    if (table->slots[slot].map == 0)
+    {
+        dblock_free(table->slots[slot].block);
+        table->slots[slot] = table->slots[--table->count];
+    }
+    frag_table_put(g, 1);
+}
+
+// ==================== EXTENT MAP ====================
+
+// Find file_block among n runs that begin at file block *base. Returns the position of the run holding it,
+// with *base left at the first file block of that run, or returns -1 with *base moved past the runs.
+static int extent_find(extent *list, int n, int file_block, int *base)
+{
+    int i;
+    for (i = 0; i < n; i++)
+    {
+        if (file_block < *base + list[i].len)
+            return i;
+        *base += list[i].len;
+    }
+    return -1;
+}
+
+// Leaf blocks reachable from an extent tree of the given depth
+static int extent_span(int depth)
+{
+    int span = depth > 0 ? 1 : 0;
+    for (; depth > 1; depth--)
+        span *= PTRS_PER_BLOCK;
+    return span;
+}
+
+// Data block holding leaf number leaf of the extent tree, walking down from the root through the
+// cached index blocks. With alloc set, leaf is the next leaf to add: the tree grows a level if it
+// is full and the missing index and leaf blocks are allocated. Returns -1 when that fails.
+static int extent_leaf(inode *node, int leaf, int alloc)
+{
+    int len_unused;
+    int goal = node->extents[0].start; // Keep the tree next to the data
+
+    while (leaf >= extent_span(node->extent_depth)) // New root above the old one
+    {
+        int root = dblock_alloc_run(goal, 1, &len_unused, 1);
+        if (root < 0)
+            return -1;
+        if (node->extent_depth > 0)
+        {
+            uint32_t *ptrs = (uint32_t *)dblock_get(root);
+            ptrs[0] = node->extent_root;
+            dblock_put(root, 1);
+        }
+        node->extent_root = root;
+        node->extent_depth++;
+    }
+
+    int block = node->extent_root;
+    int depth;
+    for (depth = node->extent_depth; depth > 1; depth--)
+    {
+        int span = extent_span(depth - 1); // Leaves below each pointer
+        uint32_t *ptrs = (uint32_t *)dblock_get(block);
+        int next;
+
+        if (alloc && leaf % span == 0) // First leaf under this pointer
+        {
+            next = dblock_alloc_run(goal, 1, &len_unused, 1);
+            if (next < 0)
+            {
+                dblock_put(block, 0);
+                return -1;
+            }
+            ptrs[leaf / span] = next;
+            dblock_put(block, 1);
+        }
+        else
+        {
+            next = ptrs[leaf / span];
+            dblock_put(block, 0);
+        }
+        block = next;
+        leaf %= span;
+    }
+    return block;
+}
+
+// Data block backing block file_block of a file, or -1 past its map. *run gets how many blocks starting
+// there are contiguous on disk, *index the position of their run in the map and *base its first file block.
+static int extent_lookup(inode *node, int file_block, int *run, int *index, int *base)
+{
+    int in_inode = node->extent_count < INODE_EXTENTS ? node->extent_count : INODE_EXTENTS;
+    int leaf, left;
+    extent found;
+
+    *base = 0;
+    *index = extent_find(node->extents, in_inode, file_block, base);
+    if (*index >= 0)
+        found = node->extents[*index];
+
+    // Then one leaf block at a time
+    for (leaf = 0, left = node->extent_count - in_inode; *index < 0 && left > 0; leaf++, left -= EXTENTS_PER_BLOCK)
+    {
+        int block = extent_leaf(node, leaf, 0);
+        extent *list = (extent *)dblock_get(block);
+        int i = extent_find(list, left < EXTENTS_PER_BLOCK ? left : EXTENTS_PER_BLOCK, file_block, base);
+        if (i >= 0)
+        {
+            found = list[i];
+            *index = INODE_EXTENTS + leaf * EXTENTS_PER_BLOCK + i;
+        }
+        dblock_put(block, 0);
+    }
+    if (*index < 0)
+        return -1;
+    *run = *base + found.len - file_block;
+    return found.start + file_block - *base;
+}
+
+// Data block backing block file_block of a file, or -1 past its map.
+// *run gets how many blocks starting there are contiguous on disk.
+static int bmap(inode *node, int file_block, int *run)
+{
+    int index, base;
+    return extent_lookup(node, file_block, run, &index, &base);
+}
+
+// Pointer to run i of a map. A run in a leaf stays pinned until extent_put, *block is set to the leaf or -1.
+static extent *extent_get(inode *node, int i, int *block)
+{
+    if (i < INODE_EXTENTS)
+    {
+        *block = -1;
+        return &node->extents[i];
+    }
+    i -= INODE_EXTENTS;
+    *block = extent_leaf(node, i / EXTENTS_PER_BLOCK, 0);
+    return (extent *)dblock_get(*block) + i % EXTENTS_PER_BLOCK;
+}
+
+static void extent_put(int block, int dirty)
+{
+    if (block >= 0)
+        dblock_put(block, dirty);
+}
+
+// Append len blocks starting at data block start to the end of a map, merging with the last run
+// when they continue it. Returns -1 if the map is full or a new leaf can not be allocated.
+static int extent_append(inode *node, int start, int len)
+{
+    int leaf_block;
+
+    if (node->extent_count > 0)
+    {
+        extent *last = extent_get(node, node->extent_count - 1, &leaf_block);
+        if (last->start + last->len == start && last->len + len <= MAX_EXTENT_LEN)
+        {
+            last->len += len;
+            extent_put(leaf_block, 1);
+            return 0;
+        }
+        extent_put(leaf_block, 0);
+    }
+
+    if (node->extent_count == MAX_EXTENTS)
+        return -1;
+    int i = node->extent_count - INODE_EXTENTS;
+    if (i >= 0 && i % EXTENTS_PER_BLOCK == 0) // First run of a new leaf
+    {
+        // A new root, the index blocks on the way down and the leaf
+        if (DATA_BLOCK_NUMBER - created_super_block->dblock_count < node->extent_depth + 1)
+            return -1;
+        if (extent_leaf(node, i / EXTENTS_PER_BLOCK, 1) < 0)
+            return -1;
+    }
+
+    extent *next = extent_get(node, node->extent_count, &leaf_block);
+    next->start = start;
+    next->len = len;
+    extent_put(leaf_block, 1);
+    node->extent_count++;
+    return 0;
+}
+
+// Free the blocks of an extent subtree of the given depth holding leaves leaf blocks
+static void extent_tree_free(int block, int depth, int leaves)
+{
+    if (depth > 1)
+    {
+        int span = extent_span(depth - 1);
+        uint32_t *ptrs = (uint32_t *)dblock_get(block);
+        int i;
+        for (i = 0; i * span < leaves; i++)
+            extent_tree_free(ptrs[i], depth - 1, leaves - i * span < span ? leaves - i * span : span);
+        dblock_put(block, 0);
+    }
+    dblock_free(block);
+}
+
+// Free every data block a map points to, and the blocks of its extent tree
+static void extent_free_all(inode *node)
+{
+    int i, j, leaf_block;
+    for (i = 0; i < node->extent_count; i++)
+    {
+        extent *run = extent_get(node, i, &leaf_block);
+        for (j = 0; j < run->len; j++)
+            dblock_free(run->start + j);
+        extent_put(leaf_block, 0);
+    }
+    if (node->extent_depth > 0)
+    {
+        int leaves = (node->extent_count - INODE_EXTENTS + EXTENTS_PER_BLOCK - 1) / EXTENTS_PER_BLOCK;
+        extent_tree_free(node->extent_root, node->extent_depth, leaves);
+    }
+    node->extent_count = 0;
+    node->extent_depth = 0;
+}
+
+// Free leaf number leaf, the last one, of an extent subtree of the given depth, and the index
+// blocks on its way down that held nothing else
+static void extent_leaf_drop(int block, int depth, int leaf)
+{
+    if (depth > 1)
+    {
+        int span = extent_span(depth - 1);
+        uint32_t *ptrs = (uint32_t *)dblock_get(block);
+        int child = ptrs[leaf / span];
+        dblock_put(block, 0);
+        extent_leaf_drop(child, depth - 1, leaf % span);
+    }
+    if (leaf == 0)
+        dblock_free(block);
+}
+
+// Drop the mapping cursors of the files open on an inode, for when its map shrinks, see fd_bmap
+static void fd_forget_map(int inode_id)
+{
+    int i;
+    for (i = 0; i < MAX_FILE_OPEN; i++)
+        if (file_desc_table[i].is_using && file_desc_table[i].inode_id == inode_id)
+            file_desc_table[i].map_len = 0;
+}
+
+// Release the last block of a map. A run that empties goes away with its leaf once that holds
+// no other run, and the tree loses levels the remaining leaves do not need.
+static void extent_pop_block(inode *node)
+{
+    int leaf_block;
+    extent *last = extent_get(node, node->extent_count - 1, &leaf_block);
+
+    dblock_free(last->start + last->len - 1);
+    last->len--;
+    int emptied = last->len == 0;
+    extent_put(leaf_block, 1);
+    if (!emptied)
+        return;
+
+    int i = --node->extent_count - INODE_EXTENTS;
+    if (i < 0 || i % EXTENTS_PER_BLOCK != 0)
+        return;
+
+    int leaves = i / EXTENTS_PER_BLOCK; // Left after dropping the last one
+    extent_leaf_drop(node->extent_root, node->extent_depth, leaves);
+    if (leaves == 0)
+    {
+        node->extent_root = 0;
+        node->extent_depth = 0;
+        return;
+    }
+    while (node->extent_depth > 1 && leaves <= extent_span(node->extent_depth - 1))
+    {
+        uint32_t *ptrs = (uint32_t *)dblock_get(node->extent_root);
+        int child = ptrs[0];
+        dblock_put(node->extent_root, 0);
+        dblock_free(node->extent_root);
+        node->extent_root = child;
+        node->extent_depth--;
+    }
+}
+
+// ==================== DIRECTORY RECORDS ====================
+
+// Length of a name as stored in a directory record
+static int name_length(char *name)
+{
+    int len = strlen(name);
+    return len > MAX_FILE_NAME ? MAX_FILE_NAME : len;
+}
+
+// FNV-1a hash of the first len bytes of a name
+static uint32_t name_hash(char *name, int len)
+{
+    uint32_t h = 2166136261u;
+    int i;
+    for (i = 0; i < len; i++)
+        h = (h ^ (unsigned char)name[i]) * 16777619u;
+    return h;
+}
+
+static bool_t dir_name_match(dir_entry *entry, char *name, int len)
+{
+    int i;
+    if (entry->name_len != len)
+        return FALSE;
+    for (i = 0; i < len; i++)
+        if (entry->file_name[i] != name[i])
+            return FALSE;
+    return TRUE;
+}
+
+// Next record of a directory block of size bytes after offset off, or NULL past the last one
+static dir_entry *dir_rec_next(char *block, int size, int *off)
+{
+    dir_entry *entry;
+    if (*off > size - (int)sizeof(dir_entry))
+        return NULL;
+    entry = (dir_entry *)(block + *off);
+    if (entry->rec_len == 0)
+        return NULL;
+    *off += entry->rec_len;
+    return entry;
+}
+
+// Bytes taken by the records of a directory block, and the offset of the last one in *last
+static int dir_block_used(char *block, int size, int *last)
+{
+    int off = 0, at = 0;
+    *last = -1;
+    while (dir_rec_next(block, size, &off) != NULL)
+    {
+        *last = at;
+        at = off;
+    }
+    return off;
+}
+
+// Offset of the record for a name with the given hash in a directory block, or -1. Records are told
+// apart by name length and stored hash, and the name is only compared when both match. Records vary
+// in length, so each one is only found from the one before and the walk stays one record at a time.
+static int dir_block_scan(char *block, int size, char *name, int len, uint32_t hash)
+{
+    int off = 0, at = 0;
+    uint16_t rec_hash = DIR_REC_HASH(hash);
+    dir_entry *entry;
+    while ((entry = dir_rec_next(block, size, &off)) != NULL)
+    {
+        if (entry->hash == rec_hash && dir_name_match(entry, name, len))
+            return at;
+        at = off;
+    }
+    return -1;
+}
+
+// Remove the record at offset off of a directory block, moving the ones after it down
+static void dir_block_cut(char *block, int size, int off)
+{
+    int last;
+    int used = dir_block_used(block, size, &last);
+    int len = ((dir_entry *)(block + off))->rec_len;
+
+    bcopy((unsigned char *)(block + off + len), (unsigned char *)(block + off), used - off - len);
+    bzero(block + used - len, len);
+}
+
+// Blocks of records in a directory, an inline directory counting as one
+static int dir_block_count(inode *dir)
+{
+    return dir->flags & INODE_INLINE ? 1 : dir->size / NEW_BLOCK_SIZE;
+}
+
+// Bytes of records a block of a directory holds
+static int dir_block_size(inode *dir)
+{
+    return dir->flags & INODE_INLINE ? INLINE_DATA_SIZE : NEW_BLOCK_SIZE;
+}
+
+// Records of block i of a directory, pinned until dir_block_put. *block_no is set to the data block, or to -1
+// for the inline area of an inode, which changes along with the inode.
+static char *dir_block_get(inode *dir, int i, int *block_no)
+{
+    int run;
+    if (dir->flags & INODE_INLINE)
+    {
+        *block_no = -1;
+        return dir->inline_data;
+    }
+    *block_no = bmap(dir, i, &run);
+    return dblock_get(*block_no);
+}
+
+static void dir_block_put(int block_no, int dirty)
+{
+    if (block_no >= 0)
+        dblock_put(block_no, dirty);
+}
+
+// ==================== DIRECTORY INDEX ====================
+
+// Bucket pointer of the root for a hash
+static uint32_t *dir_index_slot(uint32_t *root, int depth, uint32_t hash)
+{
+    return &root[hash & ((1u << depth) - 1)];
+}
+
+// Add an entry to the index of a directory, splitting full buckets on the way. Returns -1 when
+// the root can not grow any more or a bucket can not be allocated.
+static int dir_index_add(inode *dir, uint32_t hash, int block)
+{
+    uint32_t *root = (uint32_t *)dblock_get(dir->dir_index);
+    int len_unused, i;
+
+    while (1)
+    {
+        int bucket_block = *dir_index_slot(root, dir->index_depth, hash);
+        dir_index_bucket *bucket = (dir_index_bucket *)dblock_get(bucket_block);
+
+        if (bucket->count < DIR_INDEX_PER_BUCKET)
+        {
+            bucket->entries[bucket->count].hash = hash;
+            bucket->entries[bucket->count].block = block;
+            bucket->count++;
+            dblock_put(bucket_block, 1);
+            dblock_put(dir->dir_index, 1);
+            return 0;
+        }
+
+        if (bucket->depth == dir->index_depth) // Every bit is in use, double the root
+        {
+            if ((2 << dir->index_depth) > PTRS_PER_BLOCK)
+            {
+                ERROR_MSG(("Directory index full.\n"))
+                dblock_put(bucket_block, 0);
+                dblock_put(dir->dir_index, 1);
+                return -1;
+            }
+            for (i = 0; i < (1 << dir->index_depth); i++)
+                root[i + (1 << dir->index_depth)] = root[i];
+            dir->index_depth++;
+        }
+
+        // Split: entries with the next hash bit set move to a new bucket
+        int new_block = dblock_alloc_run(dir->dir_index, 1, &len_unused, 1);
+        if (new_block < 0)
+        {
+            dblock_put(bucket_block, 0);
+            dblock_put(dir->dir_index, 1);
+            return -1;
+        }
+        dir_index_bucket *sibling = (dir_index_bucket *)dblock_get(new_block);
+        uint32_t bit = 1u << bucket->depth;
+        int kept = 0;
+
+        for (i = 0; i < bucket->count; i++)
+            if (bucket->entries[i].hash & bit)
+                sibling->entries[sibling->count++] = bucket->entries[i];
+            else
+                bucket->entries[kept++] = bucket->entries[i];
+        bucket->count = kept;
+        bucket->depth++;
+        sibling->depth = bucket->depth;
+
+        for (i = (hash & (bit - 1)) | bit; i < (1 << dir->index_depth); i += bit << 1)
+            root[i] = new_block;
+
+        dblock_put(new_block, 1);
+        dblock_put(bucket_block, 1);
+    }
+}
+
+// Drop an entry of directory block block from the index of a directory
+static void dir_index_remove(inode *dir, uint32_t hash, int block)
+{
+    uint32_t *root = (uint32_t *)dblock_get(dir->dir_index);
+    int bucket_block = *dir_index_slot(root, dir->index_depth, hash);
+    dblock_put(dir->dir_index, 0);
+
+    dir_index_bucket *bucket = (dir_index_bucket *)dblock_get(bucket_block);
+    int i;
+    for (i = 0; i < bucket->count; i++)
+        if (bucket->entries[i].hash == hash && bucket->entries[i].block == block)
+        {
+            bucket->entries[i] = bucket->entries[--bucket->count];
+            break;
+        }
+    dblock_put(bucket_block, 1);
+}
+
+// An entry moved from directory block from to directory block to
+static void dir_index_reslot(inode *dir, uint32_t hash, int from, int to)
+{
+    uint32_t *root = (uint32_t *)dblock_get(dir->dir_index);
+    int bucket_block = *dir_index_slot(root, dir->index_depth, hash);
+    dblock_put(dir->dir_index, 0);
+
+    dir_index_bucket *bucket = (dir_index_bucket *)dblock_get(bucket_block);
+    int i;
+    for (i = 0; i < bucket->count; i++)
+        if (bucket->entries[i].hash == hash && bucket->entries[i].block == from)
+        {
+            bucket->entries[i].block = to;
+            break;
+        }
+    dblock_put(bucket_block, 1);
+}
+
+// Directory block holding the record for a name in an indexed directory, or -1. Sets *offset to the
+// record and *inode_id to the inode it names. Only blocks with an entry of the same hash are read.
+static int dir_index_find(inode *dir, char *name, int len, int *offset, int *inode_id)
+{
+    uint32_t hash = name_hash(name, len);
+    uint32_t *root = (uint32_t *)dblock_get(dir->dir_index);
+    int bucket_block = *dir_index_slot(root, dir->index_depth, hash);
+    dblock_put(dir->dir_index, 0);
+
+    dir_index_bucket *bucket = (dir_index_bucket *)dblock_get(bucket_block);
+    int i, run, res = -1;
+    for (i = 0; i < bucket->count && res < 0; i++)
+    {
+        if (bucket->entries[i].hash != hash)
+            continue;
+        int block_no = bmap(dir, bucket->entries[i].block, &run);
+        char *records = dblock_get(block_no);
+        *offset = dir_block_scan(records, NEW_BLOCK_SIZE, name, len, hash);
+        if (*offset >= 0)
+        {
+            *inode_id = ((dir_entry *)(records + *offset))->inode_id;
+            res = bucket->entries[i].block;
+        }
+        dblock_put(block_no, 0);
+    }
+    dblock_put(bucket_block, 0);
+    return res;
+}
+
+// Free the root and buckets of a directory's index. A bucket of depth d sits at every pointer
+// whose low d bits match its own, the first of which is below 1 << d.
+static void dir_index_free(inode *dir)
+{
+    if (dir->dir_index == 0)
+        return;
+
+    uint32_t *root = (uint32_t *)dblock_get(dir->dir_index);
+    int i;
+    for (i = 0; i < (1 << dir->index_depth); i++)
+    {
+        dir_index_bucket *bucket = (dir_index_bucket *)dblock_get(root[i]);
+        int first = i < (1 << bucket->depth);
+        dblock_put(root[i], 0);
+        if (first)
+            dblock_free(root[i]);
+    }
+    dblock_put(dir->dir_index, 0);
+    dblock_free(dir->dir_index);
+    dir->dir_index = 0;
+    dir->index_depth = 0;
+}
+
+// Index the entries of a directory that is about to get its second block
+static int dir_index_build(inode *dir)
+{
+    int len_unused, off = 0, run;
+    dir_entry *entry;
+
+    int root = dblock_alloc_run(dir->extents[0].start, 1, &len_unused, 1);
+    if (root < 0)
+        return -1;
+    int bucket = dblock_alloc_run(root + 1, 1, &len_unused, 1);
+    if (bucket < 0)
+    {
+        dblock_free(root);
+        return -1;
+    }
+
+    uint32_t *ptrs = (uint32_t *)dblock_get(root);
+    ptrs[0] = bucket; // A single bucket of depth 0 takes every hash
+    dblock_put(root, 1);
+    dir->dir_index = root;
+    dir->index_depth = 0;
+
+    int block_no = bmap(dir, 0, &run);
+    char *records = dblock_get(block_no);
+    while ((entry = dir_rec_next(records, NEW_BLOCK_SIZE, &off)) != NULL)
+        if (dir_index_add(dir, name_hash(entry->file_name, entry->name_len), 0) < 0)
+        {
+            dblock_put(block_no, 0);
+            dir_index_free(dir);
+            return -1;
+        }
+    dblock_put(block_no, 0);
+    return 0;
+}
+
+// ==================== DENTRY CACHE ====================
+
+// Forget every cached name, used when the fs underneath changes
+static void dcache_init(void)
+{
+    int i;
+    for (i = 0; i < DCACHE_SIZE; i++)
+        dentry_cache[i].parent = -1;
+}
+
+// First entry of the set a name of a directory maps to
+static int dcache_set(int parent, uint32_t hash)
+{
+    return ((hash ^ (uint32_t)parent * 2654435761u) % (DCACHE_SIZE / DCACHE_WAYS)) * DCACHE_WAYS;
+}
+
+// Cached entry for name in directory parent, or -1
+static int dcache_find(int parent, char *name, uint32_t hash)
+{
+    int i, set = dcache_set(parent, hash);
+    for (i = set; i < set + DCACHE_WAYS; i++)
+        if (dentry_cache[i].parent == parent && dentry_cache[i].hash == hash && same_string(dentry_cache[i].name, name))
+            return i;
+    return -1;
+}
+
+// Remember that name in directory parent leads to inode child
+static void dcache_insert(int parent, char *name, uint32_t hash, int child)
+{
+    int i, set = dcache_set(parent, hash), victim = -1;
+
+    // Second chance within the set
+    for (i = 0; victim < 0; i++)
+    {
+        dcache_entry *entry = &dentry_cache[set + i % DCACHE_WAYS];
+        if (entry->parent >= 0 && entry->ref)
+            entry->ref = 0;
+        else
+            victim = set + i % DCACHE_WAYS;
+    }
+
+    dentry_cache[victim].parent = parent;
+    dentry_cache[victim].child = child;
+    dentry_cache[victim].hash = hash;
+    dentry_cache[victim].ref = 1;
+    bzero(dentry_cache[victim].name, MAX_FILE_NAME);
+    strcpy_limited(name, dentry_cache[victim].name, MAX_FILE_NAME);
 }
 
-static void dblock_write(int index, char *block_buff)
+// Drop a name that left its directory
+static void dcache_forget(int parent, char *name)
 {
-    adapt_block_write(created_super_block->dblock_start + index, block_buff);
+    int i = dcache_find(parent, name, name_hash(name, name_length(name)));
+    if (i >= 0)
+        dentry_cache[i].parent = -1;
 }
 
-static void dblock_free(int index)
+// Drop every name cached for a directory that is going away, its inode number may come back
+static void dcache_forget_dir(int dir)
 {
-    int temp = read_bitmap_block(DBLOCK_BITMAP, index);
-    if (temp)
-    {
-        created_super_block->dblock_count--; // Decrease count
-        sb_write();                          // Write changes to disk
-    }
-    write_bitmap_block(DBLOCK_BITMAP, index, 0);
+    int i;
+    for (i = 0; i < DCACHE_SIZE; i++)
+        if (dentry_cache[i].parent == dir)
+            dentry_cache[i].parent = -1;
 }
 
-// ==================== FIND AVAILABLE ====================
+// ==================== DIRECTORY BLOOM FILTER ====================
 
-static int find_available(int inode_or_dt)
+static void bloom_init(void)
 {
     int i;
-    int res;
-    if (inode_or_dt)
-    { // Find free data block
-        i = (dblock_bitmap_last + 1) % DATA_BLOCK_NUMBER;
-        while (i != dblock_bitmap_last)
-        {
-            res = read_bitmap_block(DBLOCK_BITMAP, i);
-            if (res == 0)
-            {
-                dblock_bitmap_last = i; // Update last allc
-                return i;
-            }
-            i++;
-            if (i == DATA_BLOCK_NUMBER)
-                i = 0;
-        }
-    }
-    else
-    { // Next free inode
-        i = (inode_bitmap_last + 1) % MAX_FILE_COUNT;
-        while (i != inode_bitmap_last)
-        {
-            res = read_bitmap_block(INODE_BITMAP, i);
-            if (res == 0)
-            {
-                inode_bitmap_last = i; // Ipdate last allc
-                return i;
-            }
-            i++;
-            if (i == MAX_FILE_COUNT)
-                i = 0;
-        }
-    }
-    return -1;
+    for (i = 0; i < BLOOM_CACHE; i++)
+        bloom_cache[i].dir = -1;
+    bloom_hand = 0;
 }
 
-// ==================== INODE INIT READ ALLOC WRITE FREE ====================
-
-// Initializing an inode structure
-static void inode_init(inode *prop, int type)
+// Set or test the bits of a name hash. The probes are spread by double hashing, the
+// second hash being a mix of the first.
+static void bloom_add(dir_bloom *filter, uint32_t hash)
 {
-    // Initializes an inode structure by setting its properties
-    prop->size = 0;
-    prop->type = type;
-    prop->link_count = 1;
-    // Clears the block pointers in the inode
-    bzero((char *)prop->blocks, sizeof(uint16_t) * (DIRECT_BLOCK + 1));
+    uint32_t step = ((hash >> 16) | (hash << 16)) * 0x9e3779b1u | 1;
+    int i;
+    for (i = 0; i < BLOOM_HASHES; i++, hash += step)
+        filter->bits[hash % BLOOM_BITS / 64] |= 1ULL << (hash % 64);
+    filter->names++;
 }
 
-// Write an inode to a specific index in the inode block
-static void inode_write(int index, inode *inode_buff)
+static bool_t bloom_test(dir_bloom *filter, uint32_t hash)
 {
-    char temp_block_scratch[NEW_BLOCK_SIZE];
-    adapt_block_read(created_super_block->inode_start + (index / INODE_PER_BLOCK), temp_block_scratch);
-    inode *inode_block_scratch = (inode *)temp_block_scratch;
-
-    // Copy of contents of the inode buffer to the target index in the temporary inode block
-    bcopy((unsigned char *)inode_buff, (unsigned char *)(inode_block_scratch + (index % INODE_PER_BLOCK)), sizeof(inode));
-    adapt_block_write(created_super_block->inode_start + (index / INODE_PER_BLOCK), temp_block_scratch);
+    uint32_t step = ((hash >> 16) | (hash << 16)) * 0x9e3779b1u | 1;
+    int i;
+    for (i = 0; i < BLOOM_HASHES; i++, hash += step)
+        if (!(filter->bits[hash % BLOOM_BITS / 64] & (1ULL << (hash % 64))))
+            return FALSE;
+    return TRUE;
 }
 
-// Read inodes from a fs for various operations
-static void inode_read(int index, inode *inode_buff)
+// Filter of a directory if one is in memory, else NULL
+static dir_bloom *bloom_find(int dir)
 {
-    char temp_block_scratch[NEW_BLOCK_SIZE];
-    adapt_block_read(created_super_block->inode_start + (index / INODE_PER_BLOCK), temp_block_scratch);
-    inode *inode_block_scratch = (inode *)temp_block_scratch;
-
-    // Copy contents of the tgt index in the temporary inode block to the inode buffer
-    bcopy((unsigned char *)(inode_block_scratch + (index % INODE_PER_BLOCK)), (unsigned char *)inode_buff, sizeof(inode));
+    int i;
+    for (i = 0; i < BLOOM_CACHE; i++)
+        if (bloom_cache[i].dir == dir)
+        {
+            bloom_cache[i].ref = 1;
+            return &bloom_cache[i];
+        }
+    return NULL;
 }
 
-static int inode_alloc(void)
+// Build the filter of a directory, in place of one not used lately. An indexed directory
+// only has its index buckets read, they hold the hash of every name.
+static void bloom_load(int dir)
 {
-    int searched = -1;
-    searched = find_available(INODE_BITMAP); // Find the next free inode by searching the inode bitmap
+    dir_bloom *filter;
+    inode dir_inode;
+    int i, j, block_no;
 
-    if (searched >= 0) // Free inode found
+    while (bloom_cache[bloom_hand].dir >= 0 && bloom_cache[bloom_hand].ref) // CLOCK
     {
-        write_bitmap_block(INODE_BITMAP, searched, 1);
-        created_super_block->inode_count++; // Allocation counter added
-        sb_write();                         // Wb
-
-        return searched;
+        bloom_cache[bloom_hand].ref = 0;
+        bloom_hand = (bloom_hand + 1) % BLOOM_CACHE;
     }
-    return -1;
-}
+    filter = &bloom_cache[bloom_hand];
+    bloom_hand = (bloom_hand + 1) % BLOOM_CACHE;
 
-static int inode_create(int type)
-{
-    inode inode_copy; // Inode structure hold new inode info
-    int i_allocated_index;
+    bzero((char *)filter->bits, sizeof(filter->bits));
+    filter->dir = dir;
+    filter->names = 0;
+    filter->stale = 0;
+    filter->ref = 1;
 
-    i_allocated_index = inode_alloc();
+    inode_read(dir, &dir_inode);
+    if (dir_inode.dir_index != 0)
+    {
+        uint32_t *root = (uint32_t *)dblock_get(dir_inode.dir_index);
+        for (i = 0; i < (1 << dir_inode.index_depth); i++)
+        {
+            dir_index_bucket *bucket = (dir_index_bucket *)dblock_get(root[i]);
+            if (i < (1 << bucket->depth)) // First pointer to the bucket
+                for (j = 0; j < bucket->count; j++)
+                    bloom_add(filter, bucket->entries[j].hash);
+            dblock_put(root[i], 0);
+        }
+        dblock_put(dir_inode.dir_index, 0);
+        return;
+    }
 
-    if (i_allocated_index < 0) // Fail
+    for (i = 0; i < dir_block_count(&dir_inode); i++)
     {
-        return -1;
+        char *records = dir_block_get(&dir_inode, i, &block_no);
+        int off = 0;
+        dir_entry *entry;
+        while ((entry = dir_rec_next(records, dir_block_size(&dir_inode), &off)) != NULL)
+            bloom_add(filter, name_hash(entry->file_name, entry->name_len));
+        dir_block_put(block_no, 0);
     }
-    inode_init(&inode_copy, type);
-    inode_write(i_allocated_index, &inode_copy);
+}
 
-    return i_allocated_index;
+// A name left a directory. Its bits can not be cleared, so once removed names make up half of the
+// filter it is dropped and the next miss builds a fresh one.
+static void bloom_remove(int dir)
+{
+    dir_bloom *filter = bloom_find(dir);
+    if (filter != NULL && ++filter->stale * 2 > filter->names)
+        filter->dir = -1;
+}
+
+static void bloom_forget(int dir)
+{
+    dir_bloom *filter = bloom_find(dir);
+    if (filter != NULL)
+        filter->dir = -1;
 }
 
 static void inode_free(int index)
@@ -228,214 +1723,398 @@ static void inode_free(int index)
     if (temp_stat) // If the inode is marked as used
     {
         inode_read(index, &inode_temp); // Read the inode from the specified index into the temporary inode structure
-        int used_data_blocks;
-        used_data_blocks = (inode_temp.size - 1 + NEW_BLOCK_SIZE) / NEW_BLOCK_SIZE;
-
-        if (used_data_blocks > DIRECT_BLOCK) // If the number of used data blocks exceeds the number of direct blocks
-        {
-            dblock_read(inode_temp.blocks[DIRECT_BLOCK], block_copy);
-            int i;
-
-            for (i = 0; i <= DIRECT_BLOCK; i++)
-                dblock_free(inode_temp.blocks[i]); // Free the direct blocks
 
-            uint16_t *block_list = (uint16_t *)block_copy;
-
-            for (i = 0; i < used_data_blocks - DIRECT_BLOCK; i++)
-                dblock_free(block_list[i]);
-        }
-        else
-        {
-            int i;
-            for (i = 0; i < used_data_blocks; i++)
-                dblock_free(inode_temp.blocks[i]); // Free all the used data blocks
-        }
+        extent_free_all(&inode_temp);               // Release its data blocks and extent tree
+        dir_index_free(&inode_temp);
+        if (inode_temp.flags & INODE_TAIL)
+            frag_free(group_of(INODE_BITMAP, index), inode_temp.tail, tail_frags(inode_temp.size));
         write_bitmap_block(INODE_BITMAP, index, 0); // Mark the inode as free in the inode bitmap
+        inode_chunk_release(index);
         created_super_block->inode_count--;
-        sb_write(); // Update
+        if (inode_temp.type == POS_DIRECTORY)
+        {
+            group_get(group_of(INODE_BITMAP, index))->dir_count--;
+            dcache_forget_dir(index);
+            bloom_forget(index);
+        }
+        sb_mark_dirty();
     }
 }
 
-// ==================== DATA BLOCK ALLOCATION ====================
+// ==================== ALLOC MOUNT DATABLOCK TO INODE ====================
 
-static int dblock_alloc(void)
+// Allocate up to want blocks, as contiguous as possible and right after the last block of the file,
+// and mount them at the end of its map. Returns how many were mounted and sets *first to the first
+// data block, or returns -1 when nothing could be allocated. The blocks are zeroed with zero set.
+static int alloc_mount_run(int inode_id, int want, int *first, int zero)
 {
-    int search_res = -1;
-    search_res = find_available(DBLOCK_BITMAP); // Find aval
+    inode *temporary = inode_get(inode_id); // Pin the inode corresponding to inode_id
+    int goal = -1, len;
+
+    if (want > MAX_EXTENT_LEN)
+        want = MAX_EXTENT_LEN;
 
-    if (search_res >= 0) // If a free data block is found
+    if (temporary->extent_count == 0) // First block goes to the data area of the inode's group
+        goal = group_data_start(group_of(INODE_BITMAP, inode_id));
+    else
     {
-        write_bitmap_block(DBLOCK_BITMAP, search_res, 1); // Mark the data block as used in the data block bitmap
-        created_super_block->dblock_count++;
-        sb_write();
+        int leaf_block;
+        extent *last = extent_get(temporary, temporary->extent_count - 1, &leaf_block);
+        goal = last->start + last->len;
+        extent_put(leaf_block, 0);
+    }
 
-        bzero_block_custom(created_super_block->dblock_start + search_res);
-        return search_res;
+    int alloc_res = dblock_alloc_run(goal, want, &len, zero);
+    if (alloc_res < 0)
+    {
+        inode_put(inode_id, 0);
+        return -1; // If data block allocation fails, return failure
     }
-    ERROR_MSG(("Impossible to alloc."))
-    return -1;
+
+    if (extent_append(temporary, alloc_res, len) < 0)
+    {
+        int i;
+        for (i = 0; i < len; i++)
+            dblock_free(alloc_res + i);
+        inode_put(inode_id, 0);
+        return -1;
+    }
+
+    inode_put(inode_id, 1); // Updated inode is written back with its table block
+    if (first != NULL)
+        *first = alloc_res;
+    return len;
 }
 
-// ==================== ALLOC MOUNT DATABLOCK TO INODE ====================
+// ==================== INLINE DATA ====================
 
-static int alloc_mount_db(int inode_id)
+// Move the inline contents of an inode out to a data block, before it outgrows the inode.
+// A directory then takes up that whole block. Returns -1 with the inode unchanged if no block is free.
+static int inline_to_block(int inode_id)
 {
-    int alloc_res;
-    inode temporary;
+    inode *node = inode_get(inode_id);
+    char saved[INLINE_DATA_SIZE];
+    int block_no;
 
-    inode_read(inode_id, &temporary); // Read the inode corresponding to inode_id
+    bcopy((unsigned char *)node->inline_data, (unsigned char *)saved, INLINE_DATA_SIZE);
+    bzero(node->inline_data, INLINE_DATA_SIZE);
+    node->flags &= ~INODE_INLINE;
 
-    int next_block = (temporary.size - 1 + NEW_BLOCK_SIZE) / NEW_BLOCK_SIZE;
+    if (node->size == 0) // Nothing to move yet
+    {
+        inode_put(inode_id, 1);
+        return 0;
+    }
 
-    if (next_block >= DIRECT_BLOCK) // If the next block exceeds the direct block limit
+    if (alloc_mount_run(inode_id, 1, &block_no, 1) < 0)
     {
-        if (next_block == DIRECT_BLOCK)
-        {
-            alloc_res = dblock_alloc();
-            if (alloc_res < 0)
-                return -1; // If data block allocation fails, return failure
+        bcopy((unsigned char *)saved, (unsigned char *)node->inline_data, INLINE_DATA_SIZE);
+        node->flags |= INODE_INLINE;
+        inode_put(inode_id, 0);
+        return -1;
+    }
+    char *data = dblock_get(block_no);
+    bcopy((unsigned char *)saved, (unsigned char *)data, INLINE_DATA_SIZE);
+    dblock_put(block_no, 1);
 
-            temporary.blocks[DIRECT_BLOCK] = alloc_res;
-        }
-        dblock_read(temporary.blocks[DIRECT_BLOCK], block_copy);
-        uint16_t *block_list = (uint16_t *)block_copy;
+    if (node->type == POS_DIRECTORY)
+        node->size = NEW_BLOCK_SIZE;
+    inode_put(inode_id, 1);
+    return 0;
+}
 
-        alloc_res = dblock_alloc(); // Allocate a data block
-        if (alloc_res < 0)
-        {
-            if (next_block == DIRECT_BLOCK)
-                dblock_free(temporary.blocks[DIRECT_BLOCK]); // Free
-            return -1;
-        }
+// Make room for end bytes in a file kept inline or in fragments. Returns 0 when they fit in the inode or
+// in fragments, moving the contents to a longer run of fragments if needed, 1 once the file is mapped
+// by extents like any other, and -1 with the file unchanged when there is no space left.
+static int small_file_reserve(int inode_id, int end)
+{
+    inode *node = inode_get(inode_id);
+    int g = group_of(INODE_BITMAP, inode_id);
+    int want = tail_frags(end);
+    int have = node->flags & INODE_TAIL ? tail_frags(node->size) : 0;
+    int block_no, tail_block;
 
-        block_list[next_block - DIRECT_BLOCK] = alloc_res; // Mount the data block to the inode
-        dblock_write(temporary.blocks[DIRECT_BLOCK], block_copy);
+    if (!(node->flags & (INODE_INLINE | INODE_TAIL)))
+    {
+        inode_put(inode_id, 0);
+        return 1;
     }
-    else
+    if ((node->flags & INODE_INLINE && end <= INLINE_DATA_SIZE) || (node->flags & INODE_TAIL && want <= have))
+    {
+        inode_put(inode_id, 0);
+        return 0;
+    }
+
+    if (want < FRAGS_PER_BLOCK) // Still less than a block
     {
-        alloc_res = dblock_alloc(); // Allocate a data block
-        if (alloc_res < 0)
-            return -1; // If data block allocation fails, return failure
-        temporary.blocks[next_block] = alloc_res;
+        if (node->flags & INODE_TAIL && frag_grow(g, node->tail, have, want) == 0)
+        {
+            inode_put(inode_id, 0);
+            return 0;
+        }
+        int first = frag_alloc(g, want);
+        if (first >= 0)
+        {
+            char *data = tail_get(first, &block_no);
+            if (node->flags & INODE_INLINE)
+                bcopy((unsigned char *)node->inline_data, (unsigned char *)data, node->size);
+            else
+            {
+                bcopy((unsigned char *)tail_get(node->tail, &tail_block), (unsigned char *)data, node->size);
+                dblock_put(tail_block, 0);
+                frag_free(g, node->tail, have);
+            }
+            dblock_put(block_no, 1);
+
+            bzero(node->inline_data, INLINE_DATA_SIZE);
+            node->flags = (node->flags & ~INODE_INLINE) | INODE_TAIL;
+            node->tail = first;
+            inode_put(inode_id, 1);
+            return 0;
+        }
     }
+    bool_t in_tail = (node->flags & INODE_TAIL) != 0;
+    inode_put(inode_id, 0);
 
-    inode_write(inode_id, &temporary); // Write the updated inode to the disk
-    return alloc_res;
+    if (!in_tail) // No fragments to be had, or a block is needed anyway
+        return inline_to_block(inode_id) < 0 ? -1 : 1;
+
+    // Copy the fragments to a block of the file's own
+    if (alloc_mount_run(inode_id, 1, &block_no, 1) < 0)
+        return -1;
+    node = inode_get(inode_id);
+    char *data = dblock_get(block_no);
+    bcopy((unsigned char *)tail_get(node->tail, &tail_block), (unsigned char *)data, node->size);
+    dblock_put(tail_block, 0);
+    dblock_put(block_no, 1);
+    frag_free(g, node->tail, have);
+    node->flags &= ~INODE_TAIL;
+    node->tail = 0;
+    inode_put(inode_id, 1);
+    return 1;
 }
 
 // ==================== DIRECTORY ENTRY ADD ====================
 
+// Append a record for filename to the last block of a directory, or to a new block when it does not fit
 static int add_2_directory_entry(int dir_index, int son_index, char *filename)
 {
-    inode dir_inode;
-    inode_read(dir_index, &dir_inode);
-
-    int next_i;
-    next_i = dir_inode.size / (sizeof(dir_entry));
-
-    int l_index_block;
-    l_index_block = next_i / DIR_ENTRY_PER_BLOCK;
+    inode son;
+    inode_read(son_index, &son);
+
+    inode *dir_inode = inode_get(dir_index);
+    int name_len = name_length(filename);
+    int rec_len = DIR_REC_LEN(name_len);
+    uint32_t hash = name_hash(filename, name_len);
+    int block_no, last;
+
+    // An inline directory moves to a block of its own once full
+    if (dir_inode->flags & INODE_INLINE &&
+        dir_block_used(dir_inode->inline_data, INLINE_DATA_SIZE, &last) + rec_len > INLINE_DATA_SIZE &&
+        inline_to_block(dir_index) < 0)
+    {
+        inode_put(dir_index, 0);
+        return -1;
+    }
 
-    dir_entry new_entry;
-    new_entry.inode_id = son_index;
-    bzero(new_entry.file_name, MAX_FILE_NAME);
-    strcpy_limited(filename, new_entry.file_name, MAX_FILE_NAME);
+    int blocks = dir_block_count(dir_inode);
+    int target = blocks - 1, used = dir_block_size(dir_inode);
 
-    if (next_i % DIR_ENTRY_PER_BLOCK == 0)
+    if (blocks > 0)
     {
-        int alloc_res = alloc_mount_db(dir_index);
-
-        // update inode
-        inode_read(dir_index, &dir_inode);
+        used = dir_block_used(dir_block_get(dir_inode, target, &block_no), dir_block_size(dir_inode), &last);
+        dir_block_put(block_no, 0);
+    }
+    if (used + rec_len > dir_block_size(dir_inode))
+        target = blocks;
 
-        dblock_read(alloc_res, block_copy);
-        dir_entry *entry_list = (dir_entry *)block_copy;
-        entry_list[0] = new_entry;
-        dblock_write(alloc_res, block_copy);
+    // Past one block the directory is indexed, the index is set up before the second block
+    if (dir_inode->dir_index == 0 && target == 1 && dir_index_build(dir_inode) < 0)
+    {
+        inode_put(dir_index, 1);
+        return -1;
     }
-    else
+    if (dir_inode->dir_index != 0 && dir_index_add(dir_inode, hash, target) < 0)
     {
-        if (l_index_block >= DIRECT_BLOCK)
-        {
-            dblock_read(dir_inode.blocks[DIRECT_BLOCK], block_copy);
-            uint16_t *block_list = (uint16_t *)block_copy;
-            l_index_block = block_list[l_index_block - DIRECT_BLOCK]; // get real block no
-        }
-        else
+        inode_put(dir_index, 1);
+        return -1;
+    }
+
+    if (target == blocks)
+    {
+        // Mounting updates the same cached inode dir_inode points to
+        if (alloc_mount_run(dir_index, 1, &block_no, 1) < 0)
         {
-            l_index_block = dir_inode.blocks[l_index_block];
+            if (dir_inode->dir_index != 0)
+                dir_index_remove(dir_inode, hash, target);
+            inode_put(dir_index, 1);
+            return -1;
         }
+        dir_inode->size += NEW_BLOCK_SIZE;
+        used = 0;
+    }
 
-        dblock_read(l_index_block, block_copy);
-
-        dir_entry *entry_list = (dir_entry *)block_copy;
-        entry_list[next_i % DIR_ENTRY_PER_BLOCK] = new_entry;
+    dir_entry *entry = (dir_entry *)(dir_block_get(dir_inode, target, &block_no) + used);
+    entry->inode_id = son_index;
+    entry->rec_len = rec_len;
+    entry->name_len = name_len;
+    entry->file_type = son.type;
+    entry->hash = DIR_REC_HASH(hash);
+    bcopy((unsigned char *)filename, (unsigned char *)entry->file_name, name_len);
+    dir_block_put(block_no, 1);
 
-        dblock_write(l_index_block, block_copy);
-    }
+    inode_put(dir_index, 1);
 
-    dir_inode.size += sizeof(dir_entry);
-    inode_write(dir_index, &dir_inode);
+    dir_bloom *filter = bloom_find(dir_index);
+    if (filter != NULL)
+        bloom_add(filter, hash);
     return 0;
 }
 
+// Directory block holding the record for filename, or -1. Sets *offset to the record and *inode_id
+// to the inode it names.
+static int dir_entry_locate(inode *dir_inode, char *filename, int *offset, int *inode_id)
+{
+    int len = strlen(filename);
+    if (len > MAX_FILE_NAME)
+        return -1;
+    if (dir_inode->dir_index != 0)
+        return dir_index_find(dir_inode, filename, len, offset, inode_id);
+
+    uint32_t hash = name_hash(filename, len);
+    int i, block_no;
+    for (i = 0; i < dir_block_count(dir_inode); i++)
+    {
+        char *records = dir_block_get(dir_inode, i, &block_no);
+        *offset = dir_block_scan(records, dir_block_size(dir_inode), filename, len, hash);
+        if (*offset >= 0)
+            *inode_id = ((dir_entry *)(records + *offset))->inode_id;
+        dir_block_put(block_no, 0);
+        if (*offset >= 0)
+            return i;
+    }
+    return -1;
+}
+
+// Inode named filename in a directory, or -1. Names found are kept in the dentry cache.
 static int dir_entry_find(int dir_index, char *filename)
 {
     inode dir_inode;
+    int inode_id, offset;
+    uint32_t hash = name_hash(filename, name_length(filename));
+
+    int cached = dcache_find(dir_index, filename, hash);
+    if (cached >= 0)
+    {
+        dcache_hits++;
+        dentry_cache[cached].ref = 1;
+        return dentry_cache[cached].child;
+    }
+    dcache_misses++;
+
+    // A directory that had a miss keeps a filter to turn down the next ones without reading it
+    dir_bloom *filter = bloom_find(dir_index);
+    if (filter != NULL && !bloom_test(filter, hash))
+    {
+        bloom_rejects++;
+        return -1;
+    }
+
     inode_read(dir_index, &dir_inode);
-    int total_entry_num = dir_inode.size / (sizeof(dir_entry));
-    int total_block_num = (total_entry_num - 1 + DIR_ENTRY_PER_BLOCK) / DIR_ENTRY_PER_BLOCK;
-    if (total_entry_num == 0)
+    if (dir_entry_locate(&dir_inode, filename, &offset, &inode_id) < 0)
+    {
+        if (filter == NULL)
+            bloom_load(dir_index);
         return -1;
+    }
+    dcache_insert(dir_index, filename, hash, inode_id);
+    return inode_id;
+}
+
+// ==================== DIRECTORY ENTRY REMOVE ====================
+
+// Remove the record of filename from a directory and drop it from the index. Returns the inode it named, or -1.
+// The records after it in its block move down, and records from the end of the last block move into the room
+// left, so that space is reused and free space collects in the last block. Once that is empty it is
+// released, with the extent tree blocks that only served it.
+static int dir_entry_remove(int dir_index, char *filename)
+{
+    inode *dir_inode = inode_get(dir_index);
+    int inode_id, offset, last, block_no;
+    int size = dir_block_size(dir_inode);
 
-    if (total_block_num > DIRECT_BLOCK)
+    int target = dir_entry_locate(dir_inode, filename, &offset, &inode_id);
+    if (target < 0)
     {
-        int i, j;
+        inode_put(dir_index, 0);
+        return -1;
+    }
 
-        dblock_read(dir_inode.blocks[DIRECT_BLOCK], block_copy);
-        uint16_t *block_list = (uint16_t *)block_copy;
+    if (dir_inode->dir_index != 0)
+        dir_index_remove(dir_inode, name_hash(filename, strlen(filename)), target);
+    dcache_forget(dir_index, filename);
+    bloom_remove(dir_index);
 
-        for (i = 0; i < total_block_num - DIRECT_BLOCK - 1; i++)
-        {
-            dblock_read(block_list[i], block_copy_copy);
-            dir_entry *entry_list = (dir_entry *)block_copy_copy;
-            for (j = 0; j < DIR_ENTRY_PER_BLOCK; j++)
-                if (same_string(entry_list[j].file_name, filename))
-                    return entry_list[j].inode_id;
-        }
-        dblock_read(block_list[total_block_num - DIRECT_BLOCK - 1], block_copy_copy);
-        int final_end = (total_entry_num - 1) % DIR_ENTRY_PER_BLOCK;
-        dir_entry *entry_list = (dir_entry *)block_copy_copy;
-        for (j = 0; j <= final_end; j++)
+    char *records = dir_block_get(dir_inode, target, &block_no);
+    dir_block_cut(records, size, offset);
+    int used = dir_block_used(records, size, &last);
+
+    int last_index = dir_block_count(dir_inode) - 1;
+    int last_used = used;
+    if (target != last_index)
+    {
+        int last_block;
+        char *last_records = dir_block_get(dir_inode, last_index, &last_block);
+
+        while ((last_used = dir_block_used(last_records, size, &last)) > 0)
         {
-            if (same_string(entry_list[j].file_name, filename))
-                return entry_list[j].inode_id;
+            dir_entry *moved = (dir_entry *)(last_records + last);
+            if (used + moved->rec_len > size)
+                break;
+            bcopy((unsigned char *)moved, (unsigned char *)(records + used), moved->rec_len);
+            used += moved->rec_len;
+            if (dir_inode->dir_index != 0)
+                dir_index_reslot(dir_inode, name_hash(moved->file_name, moved->name_len), last_index, target);
+            bzero((char *)moved, moved->rec_len);
         }
-
-        total_block_num = DIRECT_BLOCK;
-        total_entry_num = DIRECT_BLOCK * DIR_ENTRY_PER_BLOCK;
+        dir_block_put(last_block, 1);
     }
-    int i, j, entry_block;
-    for (i = 0; i < total_block_num - 1; i++)
+    dir_block_put(block_no, 1);
+
+    if (last_used == 0 && last_index > 0) // The last block is empty now
     {
-        entry_block = dir_inode.blocks[i];
-        dblock_read(entry_block, block_copy);
-        dir_entry *entry_list = (dir_entry *)block_copy;
-        for (j = 0; j < DIR_ENTRY_PER_BLOCK; j++)
-            if (same_string(entry_list[j].file_name, filename))
-                return entry_list[j].inode_id;
+        dir_inode->size -= NEW_BLOCK_SIZE;
+        extent_pop_block(dir_inode);
+        fd_forget_map(dir_index);
     }
-    int final_end = (total_entry_num - 1) % DIR_ENTRY_PER_BLOCK;
-    entry_block = dir_inode.blocks[total_block_num - 1];
-    dblock_read(entry_block, block_copy);
-    dir_entry *entry_list = (dir_entry *)block_copy;
-    for (j = 0; j <= final_end; j++)
+
+    inode_put(dir_index, 1);
+    return inode_id;
+}
+
+// True if a directory holds nothing besides "." and ".."
+static bool_t dir_is_empty(int dir_index)
+{
+    inode dir_inode;
+    inode_read(dir_index, &dir_inode);
+
+    int i, block_no;
+    bool_t empty = TRUE;
+
+    for (i = 0; i < dir_block_count(&dir_inode) && empty; i++)
     {
-        if (same_string(entry_list[j].file_name, filename))
-            return entry_list[j].inode_id;
+        char *records = dir_block_get(&dir_inode, i, &block_no);
+        int off = 0;
+        dir_entry *entry;
+        while ((entry = dir_rec_next(records, dir_block_size(&dir_inode), &off)) != NULL)
+            if (!dir_name_match(entry, ".", 1) && !dir_name_match(entry, "..", 2))
+            {
+                empty = FALSE;
+                break;
+            }
+        dir_block_put(block_no, 0);
     }
-
-    return -1;
+    return empty;
 }
 
 //==================== FD OPERATIONS ====================
@@ -450,11 +2129,30 @@ static int fd_open(int inode_id, int mode)
             file_desc_table[i].cursor = 0;
             file_desc_table[i].inode_id = inode_id;
             file_desc_table[i].mode = mode;
+            file_desc_table[i].map_len = 0;
+            file_desc_table[i].ra_last = -1;
+            file_desc_table[i].ra_window = 0;
+            file_desc_table[i].ra_end = 0;
             return i;
         }
     ERROR_MSG(("Not enough file descriptor!\n"))
     return -1;
 }
+// 0 for a descriptor in use, else -1
+static int fd_check(int fd)
+{
+    if (fd < 0 || fd >= MAX_FILE_OPEN)
+    {
+        ERROR_MSG(("Wrong input for file descriptor.\n"))
+        return -1;
+    }
+    if (file_desc_table[fd].is_using == FALSE)
+    {
+        ERROR_MSG(("%d this file descriptor is not in use.\n", fd))
+        return -1;
+    }
+    return 0;
+}
 static void fd_close(int fd)
 {
     file_desc_table[fd].is_using = FALSE;
@@ -469,8 +2167,152 @@ static int fd_find_same_num(int inode_id)
     return count;
 }
 
+// bmap for an open file, through its mapping cursor: the run of the map it resolved last. Blocks of
+// that run, or of the next one once a stream reaches it, are found without searching the map. Runs
+// are appended to a file's map or grown at its end, which the cursor picks up as it goes; a map that
+// gives blocks back drops the cursors on it through fd_forget_map.
+static int fd_bmap(int fd, inode *node, int file_block, int *run)
+{
+    file_desc_structure *desc = &file_desc_table[fd];
+    int index, base, leaf_block;
+
+    if (desc->map_len > 0 && file_block >= desc->map_base + desc->map_len && desc->map_index + 1 < node->extent_count)
+    {
+        extent *now = extent_get(node, desc->map_index, &leaf_block);
+        desc->map_len = now->len; // Picks up growth, or the next run would start too early
+        extent_put(leaf_block, 0);
+        if (file_block >= desc->map_base + desc->map_len)
+        {
+            extent *next = extent_get(node, desc->map_index + 1, &leaf_block);
+            desc->map_index++;
+            desc->map_base += desc->map_len;
+            desc->map_start = next->start;
+            desc->map_len = next->len;
+            extent_put(leaf_block, 0);
+        }
+    }
+
+    if (desc->map_len == 0 || file_block < desc->map_base || file_block >= desc->map_base + desc->map_len)
+    {
+        int block = extent_lookup(node, file_block, run, &index, &base);
+        if (block < 0)
+            return -1;
+        desc->map_index = index;
+        desc->map_base = base;
+        desc->map_start = block - (file_block - base);
+        desc->map_len = file_block - base + *run;
+    }
+    *run = desc->map_base + desc->map_len - file_block;
+    return desc->map_start + file_block - desc->map_base;
+}
+
+// Readahead for a read of file blocks first to last. A read going on in the block after the last one opens
+// the window or doubles it, one staying in that block leaves it as it is, any other read closes it. Once less than half the window is left in the
+// cache past last, the blocks up to a full window are read in, a run of them per device request.
+static void fd_readahead(int fd, inode *node, int first, int last)
+{
+    file_desc_structure *desc = &file_desc_table[fd];
+    int max = BCACHE_PREFETCH_MAX / NEW_BLOCK_SIZE < RA_MAX_BLOCKS ? BCACHE_PREFETCH_MAX / NEW_BLOCK_SIZE : RA_MAX_BLOCKS;
+    int blocks = (node->size + NEW_BLOCK_SIZE - 1) / NEW_BLOCK_SIZE;
+    int from, end, run;
+
+    if (first == desc->ra_last + 1)
+        desc->ra_window = desc->ra_window == 0 ? RA_MIN_BLOCKS : desc->ra_window * 2;
+    else if (first != desc->ra_last)
+    {
+        desc->ra_window = 0;
+        desc->ra_end = 0;
+    }
+    if (desc->ra_window > max)
+        desc->ra_window = max;
+    desc->ra_last = last;
+
+    from = desc->ra_end > last + 1 ? desc->ra_end : last + 1;
+    end = last + 1 + desc->ra_window;
+    if (end > blocks)
+        end = blocks;
+    if (desc->ra_window == 0 || (from - last - 1) * 2 >= desc->ra_window || from >= end)
+        return;
+
+    // Looking ahead must not move the mapping cursor off the blocks being read
+    uint32_t map_index = desc->map_index, map_base = desc->map_base;
+    uint32_t map_start = desc->map_start, map_len = desc->map_len;
+    while (from < end)
+    {
+        int block = fd_bmap(fd, node, from, &run);
+        if (block < 0)
+            break;
+        if (run > end - from)
+            run = end - from;
+        int done = bcache_prefetch(created_super_block->dblock_start + block, run);
+        from += done;
+        if (done < run)
+            break;
+    }
+    desc->map_index = map_index;
+    desc->map_base = map_base;
+    desc->map_start = map_start;
+    desc->map_len = map_len;
+    desc->ra_end = from;
+}
+
+// ==================== IO VECTORS ====================
+
+// Bytes in the iovcnt pieces of iov, or -1 when there are not that many
+static int iov_total(fsIovec *iov, int iovcnt)
+{
+    int i, total = 0;
+
+    if (iovcnt < 0)
+        return -1;
+    for (i = 0; i < iovcnt; i++)
+    {
+        if (iov[i].len < 0 || iov[i].len > MAX_FILE_SIZE - total)
+            return -1;
+        total += iov[i].len;
+    }
+    return total;
+}
+
+// Copy count bytes between mem and the pieces from *iov on, skipping the first *skip bytes of the
+// first one: from the pieces into mem when gather is set, else the other way around. Moves *iov and
+// *skip past the bytes copied.
+static void iov_copy(fsIovec **iov, int *skip, char *mem, int count, int gather)
+{
+    while (count > 0)
+    {
+        int n = (*iov)->len - *skip;
+        if (n == 0)
+        {
+            (*iov)++;
+            *skip = 0;
+            continue;
+        }
+        if (n > count)
+            n = count;
+        if (gather)
+            bcopy((unsigned char *)((*iov)->base + *skip), (unsigned char *)mem, n);
+        else
+            bcopy((unsigned char *)mem, (unsigned char *)((*iov)->base + *skip), n);
+        mem += n;
+        count -= n;
+        *skip += n;
+    }
+}
+
 // ==================== PATH RESOLVE ====================
 
+// Last component of a path, the name of its entry in the parent directory
+static char *path_base_name(char *file_path)
+{
+    char *base_name = file_path;
+    int i;
+    for (i = 0; file_path[i] != '\0'; i++)
+        if (file_path[i] == '/')
+            base_name = file_path + i + 1;
+    return base_name;
+}
+
 static int path_index_resolve(char *file_path, int temp_pwd)
 {
     int path_len = strlen(file_path);
@@ -558,4 +2400,45 @@ static int path_resolve(char *file_path, int temp_pwd, int mode)
         file_path[path_len - 1] = '\0';
 
     return path_index_resolve(file_path, temp_pwd);
-}
\ No newline at end of file
+}
+
+// ==================== COMMIT / CHECKPOINT ====================
+
+// Commit point: write back the changed bitmap sectors, the primary superblock, dirty inodes and cached blocks
+static void fs_commit(void)
+{
+    bitmap_commit(INODE_BITMAP);
+    bitmap_commit(DBLOCK_BITMAP);
+
+    if (sb_dirty)
+    {
+        sb_write(SUPER_BLOCK_SECTOR);
+        sb_dirty = FALSE;
+    }
+
+    icache_flush();
+    bcache_flush();
+    last_commit = FS_CLOCK();
+}
+
+// Checkpoint: a commit that also refreshes the backup superblock and forces everything to disk. The
+// primary is on disk before the backup is written, so the backup is never the newer of the two.
+static void fs_checkpoint(void)
+{
+    fs_commit();
+    if (sb_backup_dirty)
+    {
+        block_sync();
+        sb_write(SUPER_BLOCK_BACKUP);
+        sb_backup_dirty = FALSE;
+    }
+    block_sync();
+}
+
+// Timer commit point: commit once COMMIT_INTERVAL seconds have gone by since the last commit. There is
+// no timer interrupt to hang it on, so the calls that change the fs check on their way out.
+static void fs_commit_tick(void)
+{
+    if (FS_CLOCK() - last_commit >= COMMIT_INTERVAL)
+        fs_commit();
+}
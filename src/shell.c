@@ -26,6 +26,10 @@ static void shell_mkfs(void);
 static void shell_open(void);
 static void shell_read(void);
 static void shell_write(void);
+static void shell_pread(void);
+static void shell_pwrite(void);
+static void shell_readv(void);
+static void shell_writev(void);
 static void shell_lseek(void);
 static void shell_close(void);
 static void shell_mkdir(void);
@@ -34,6 +38,8 @@ static void shell_cd(void);
 static void shell_link(void);
 static void shell_unlink(void);
 static void shell_stat(void);
+static void shell_sync(void);
+static void shell_stats(void);
 
 static void shell_ls(void);
 static void shell_create(void);
@@ -74,11 +80,15 @@ int START(void)
 		EXEC_COMMAND("exit", 1, 1, "", shell_exit());
 		EXEC_COMMAND("fire", 1, 1, "", shell_fire());
 		EXEC_COMMAND("clear", 1, 1, "", shell_clearscreen());
-		EXEC_COMMAND("mkfs", 1, 1, "", shell_mkfs());
+		EXEC_COMMAND("mkfs", 1, 4, " [size_mb [block_size [inodes]]]", shell_mkfs());
 		EXEC_COMMAND("open", 3, 3, "", shell_open());
 		EXEC_COMMAND("read", 3, 3, "", shell_read());
 		EXEC_COMMAND("write", 3, 3, "", shell_write());
-		EXEC_COMMAND("lseek", 3, 3, "", shell_lseek());
+		EXEC_COMMAND("pread", 4, 4, " fd count offset", shell_pread());
+		EXEC_COMMAND("pwrite", 4, 4, " fd data offset", shell_pwrite());
+		EXEC_COMMAND("readv", 3, 6, " fd count [count [count [count]]]", shell_readv());
+		EXEC_COMMAND("writev", 3, 6, " fd data [data [data [data]]]", shell_writev());
+		EXEC_COMMAND("lseek", 3, 4, " fd offset [whence]", shell_lseek());
 		EXEC_COMMAND("mkdir", 2, 2, "", shell_mkdir());
 		EXEC_COMMAND("rmdir", 2, 2, "", shell_rmdir());
 		EXEC_COMMAND("cd", 2, 2, "", shell_cd());
@@ -86,6 +96,8 @@ int START(void)
 		EXEC_COMMAND("link", 3, 3, "", shell_link());
 		EXEC_COMMAND("unlink", 2, 2, "", shell_unlink());
 		EXEC_COMMAND("stat", 2, 2, "", shell_stat());
+		EXEC_COMMAND("sync", 1, 1, "", shell_sync());
+		EXEC_COMMAND("stats", 1, 1, "", shell_stats());
 		EXEC_COMMAND("ls", 1, 2, "", shell_ls());
 		EXEC_COMMAND("create", 3, 3, "", shell_create());
 		EXEC_COMMAND("cat", 2, 2, "", shell_cat());
@@ -146,6 +158,7 @@ static void readLine(void)
 
 static void shell_exit(void)
 {
+	fs_sync();
 	writeStr("Goodbye\n");
 #ifdef FAKE
 	exit(0);
@@ -166,7 +179,12 @@ static void shell_clearscreen(void)
 
 static void shell_mkfs(void)
 {
-	if (fs_mkfs() != 0)
+	fsGeometry geometry;
+
+	geometry.imageMB = argc > 1 ? atoi(argv[1]) : 0;
+	geometry.blockSize = argc > 2 ? atoi(argv[2]) : 0;
+	geometry.inodeCount = argc > 3 ? atoi(argv[3]) : 0;
+	if (fs_mkfs(&geometry) != 0)
 		writeStr("mkfs failed\n");
 }
 
@@ -239,9 +257,92 @@ static void shell_write(void)
 		writeStr("Done\n");
 }
 
+static void shell_pread(void)
+{
+	char data[SIZEX];
+	int i, n, count;
+
+	n = atoi(argv[2]);
+	if (n > SIZEX)
+	{
+		writeStr("Requested size too big\n");
+		return;
+	}
+	if ((count = fs_pread(atoi(argv[1]), data, n, atoi(argv[3]))) == -1)
+		writeStr("Read failed\n");
+	else
+	{
+		writeStr("Data read in : ");
+		for (i = 0; i < count; i++)
+			writeChar(data[i]);
+		writeChar(RETURN);
+	}
+}
+
+static void shell_pwrite(void)
+{
+	if (fs_pwrite(atoi(argv[1]), argv[2], strlen(argv[2]), atoi(argv[3])) == -1)
+		writeStr("Error while writing file\n");
+	else
+		writeStr("Done\n");
+}
+
+static void shell_readv(void)
+{
+	char data[SIZEX];
+	fsIovec iov[4];
+	int i, j, n, count, total = 0;
+
+	for (i = 2; i < argc; i++)
+	{
+		n = atoi(argv[i]);
+		if (n < 0 || n > SIZEX - total)
+		{
+			writeStr("Requested size too big\n");
+			return;
+		}
+		iov[i - 2].base = data + total;
+		iov[i - 2].len = n;
+		total += n;
+	}
+	if ((count = fs_readv(atoi(argv[1]), iov, argc - 2)) == -1)
+		writeStr("Read failed\n");
+	else
+	{
+		// One piece after the other, split by '|'
+		writeStr("Data read in : ");
+		for (i = 0; i < argc - 2 && count > 0; i++)
+		{
+			for (j = 0; j < iov[i].len && j < count; j++)
+				writeChar(iov[i].base[j]);
+			count -= j;
+			writeChar('|');
+		}
+		writeChar(RETURN);
+	}
+}
+
+static void shell_writev(void)
+{
+	fsIovec iov[4];
+	int i;
+
+	for (i = 2; i < argc; i++)
+	{
+		iov[i - 2].base = argv[i];
+		iov[i - 2].len = strlen(argv[i]);
+	}
+	if (fs_writev(atoi(argv[1]), iov, argc - 2) == -1)
+		writeStr("Error while writing file\n");
+	else
+		writeStr("Done\n");
+}
+
 static void shell_lseek(void)
 {
-	if (fs_lseek(atoi(argv[1]), atoi(argv[2])) == -1)
+	int whence = argc > 3 ? atoi(argv[3]) : FS_SEEK_SET;
+
+	if (fs_lseek(atoi(argv[1]), atoi(argv[2]), whence) == -1)
 		writeStr("Problem with seeking\n");
 	else
 		writeStr("OK\n");
@@ -353,6 +454,58 @@ static void shell_stat(void)
 		writeStr("Stat failed\n");
 }
 
+static void shell_sync(void)
+{
+	if (fs_sync() == -1)
+		writeStr("Problem with sync\n");
+	else
+		writeStr("OK\n");
+}
+
+static void shell_stats(void)
+{
+#ifdef FAKE
+	fs_counters counters;
+	char s[12];
+
+	fs_counters_read(&counters);
+	itoa(counters.cache_hits, s);
+	writeStr("    Cache hits       : ");
+	writeStr(s);
+	writeChar(RETURN);
+	itoa(counters.cache_misses, s);
+	writeStr("    Cache misses     : ");
+	writeStr(s);
+	writeChar(RETURN);
+	itoa(counters.cache_writebacks, s);
+	writeStr("    Cache writebacks : ");
+	writeStr(s);
+	writeChar(RETURN);
+	itoa(counters.dentry_hits, s);
+	writeStr("    Dentry hits      : ");
+	writeStr(s);
+	writeChar(RETURN);
+	itoa(counters.dentry_misses, s);
+	writeStr("    Dentry misses    : ");
+	writeStr(s);
+	writeChar(RETURN);
+	itoa(counters.bloom_rejects, s);
+	writeStr("    Bloom rejects    : ");
+	writeStr(s);
+	writeChar(RETURN);
+	itoa(counters.readahead_hits, s);
+	writeStr("    Readahead hits   : ");
+	writeStr(s);
+	writeChar(RETURN);
+	itoa(counters.readahead_waste, s);
+	writeStr("    Readahead waste  : ");
+	writeStr(s);
+	writeChar(RETURN);
+#else
+	writeStr("Not supported.\n");
+#endif
+}
+
 static void shell_cat(void)
 {
 	int fd, n, i;
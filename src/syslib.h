@@ -12,17 +12,24 @@ enum {
 	IGNORE		= 0
 };	
 
-int fs_mkfs( void);
+int fs_mkfs( fsGeometry *geometry);
 int fs_open( char *filename, int flags);
 int fs_close( int fd);
 int fs_read( int fd, char *buf, int count);
 int fs_write( int fd, char *buf, int count);
-int fs_lseek( int fd, int offset);
+int fs_pread( int fd, char *buf, int count, int offset);
+int fs_pwrite( int fd, char *buf, int count, int offset);
+int fs_readv( int fd, fsIovec *iov, int iovcnt);
+int fs_writev( int fd, fsIovec *iov, int iovcnt);
+int fs_preadv( int fd, fsIovec *iov, int iovcnt, int offset);
+int fs_pwritev( int fd, fsIovec *iov, int iovcnt, int offset);
+int fs_lseek( int fd, int offset, int whence);
 int fs_mkdir( char *fileName);
 int fs_rmdir( char *fileName);
 int fs_cd( char *pathName);
 int fs_link( char *pathName, char *fileName);
 int fs_unlink( char *fileName);
 int fs_stat( char *fileName, fileStat *buf);
+int fs_sync( void);
 
 #endif
@@ -26,8 +26,8 @@ def test_large_file():
     issue('create large_file 10000000')
     issue('stat large_file') # blocks: 1914, size: 975872
     issue('create f 100') #should fail
-    check_fs_size();
     do_exit();
+    check_fs_size();
 
 # create a directory with enough files that the directory needs to be resized into
 # an inode with indirect pointers
@@ -92,6 +92,126 @@ def test_get_all_inodes():
         issue('close 0')
     do_exit()
 
+# opening a missing file for writing creates it, read only does not
+def test_open_create():
+    issue('mkfs')
+    issue('open f 1') # should fail
+    issue('open f 3') # File handle is : 0
+    issue('close 0')
+    issue('open f 1') # File handle is : 0
+    issue('ls') # f
+    do_exit()
+
+# writes mount data blocks as the file grows past the blocks it has
+def test_write_grow():
+    issue('mkfs')
+    issue('create f 5000') # needs two blocks
+    issue('open f 1')
+    issue('read 0 45') # ABC...
+    issue('close 0')
+    issue('create g 10000000') # stops when the disk is full
+    issue('create h 100') # should fail
+    do_exit()
+
+# removing names: unlink for files, rmdir for empty directories
+def test_unlink_rmdir():
+    issue('mkfs')
+    issue('mkdir d')
+    issue('create d/a 10')
+    issue('rmdir d') # should fail, d is not empty
+    issue('unlink d') # should fail, d is a dir
+    issue('unlink d/a')
+    issue('rmdir d')
+    issue('ls') # nothing left
+    issue('unlink nothing') # should fail
+    issue('rmdir ..') # should fail
+    issue('open f 3')
+    issue('unlink f')
+    issue('ls') # f is gone, its inode stays until the close
+    issue('close 0')
+    do_exit()
+
+# a second name for a file outlives the first
+def test_link():
+    issue('mkfs')
+    issue('create a 10')
+    issue('link a b')
+    issue('cat b') # ABCDEFGHIJ
+    issue('link a b') # should fail, b exists
+    issue('link nothing c') # should fail
+    issue('mkdir d')
+    issue('link d e') # should fail, d is a dir
+    issue('unlink a')
+    issue('cat b') # ABCDEFGHIJ
+    issue('stats') # dentry hits and misses
+    do_exit()
+
+def test_mkfs_geometry():
+    issue('mkfs') # 1 MiB image, 4 KiB blocks, 2048 inodes
+    issue('mkfs 4 8192') # 4 MiB image with 8 KiB blocks
+    issue('create a 10')
+    issue('cat a') # ABCDEFGHIJ
+    issue('mkfs 4 100') # Unsupported geometry. mkfs failed
+    issue('mkfs 4 4096 64')
+    for x in range(0, 64):
+        issue('create f%d 1' %x) # the last create fails, the root takes an inode
+    do_exit()
+
+def test_pread_pwrite_lseek():
+    issue('mkfs')
+    issue('open f 3')
+    issue('write 0 hello')
+    issue('pwrite 0 HE 0') # cursor stays at the end
+    issue('read 0 10') # Data read in :
+    issue('pread 0 5 0') # HEllo
+    issue('pwrite 0 X 5')
+    issue('pread 0 10 3') # loX
+    issue('lseek 0 -3 2') # from the end
+    issue('read 0 10') # loX
+    issue('lseek 0 1 0')
+    issue('lseek 0 2 1') # from the cursor
+    issue('read 0 2') # lo
+    issue('lseek 0 -9 1') # Wrong offset input!
+    issue('lseek 0 0 7') # Wrong whence input!
+    issue('pread 5 1 0') # Read failed
+    do_exit()
+
+def test_readv_writev():
+    issue('mkfs')
+    issue('open f 3')
+    issue('writev 0 abc de fghij') # Done
+    issue('lseek 0 0')
+    issue('readv 0 2 4 10') # ab|cdef|ghij|
+    issue('lseek 0 1')
+    issue('readv 0 3 3') # bcd|efg|
+    issue('readv 0 5') # hij|
+    issue('readv 0 -1') # Requested size too big
+    do_exit()
+
+def test_sync():
+    issue('mkfs')
+    issue('mkdir d')
+    issue('create d/a 10')
+    issue('sync') # OK
+    do_exit()
+    spawn_lnxsh() # the image is mounted again
+    issue('cat d/a') # ABCDEFGHIJ
+    issue('ls') # . .. d
+    do_exit()
+
+def test_stats():
+    issue('mkfs')
+    issue('create a 100')
+    issue('cat a')
+    issue('stats')
+    issue('cat a')
+    issue('stats') # cache hits grow with the second cat, misses stay put
+    issue('open b 3')
+    issue('write 0 hello')
+    issue('stats')
+    issue('sync')
+    issue('stats') # cache writebacks grow with sync, the write was held in the cache
+    do_exit()
 
 print ("......Starting my tests\n\n")
 
@@ -109,3 +229,21 @@ spawn_lnxsh()
 # spawn_lnxsh()
 # test_get_all_inodes()
 # spawn_lnxsh()
+# test_open_create()
+# spawn_lnxsh()
+# test_write_grow()
+# spawn_lnxsh()
+# test_unlink_rmdir()
+# spawn_lnxsh()
+# test_link()
+# spawn_lnxsh()
+# test_mkfs_geometry()
+# spawn_lnxsh()
+# test_pread_pwrite_lseek()
+# spawn_lnxsh()
+# test_readv_writev()
+# spawn_lnxsh()
+# test_sync()
+# spawn_lnxsh()
+# test_stats()
+# spawn_lnxsh()